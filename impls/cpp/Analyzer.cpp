@@ -0,0 +1,829 @@
+#include "MAL.h"
+#include "Environment.h"
+#include "Types.h"
+
+#include <iostream>
+#include <memory>
+
+// The analyser compiles a fn* body, once, into a tree of executor nodes
+// which is kept on the malLambda. Running the tree skips all the work that
+// EVAL repeats each time it sees a form: the type checks, the special form
+// dispatch, the argument count checks and the search for each variable.
+//
+// Local variables are resolved to a frame depth and slot. Symbols which no
+// frame between the fn* and the root can bind go straight to the root, and
+// anything else is looked up by name.
+//
+// A call in tail position doesn't call a lambda itself. It hands the
+// lambda and arguments back to the trampoline in Code::execute, so tail
+// calls don't grow the stack.
+//
+// Malformed special forms are left to EVAL, so that they report the same
+// errors at the same time as they always have.
+
+namespace {
+
+// Filled in by a call in tail position, instead of making the call.
+struct TailCall {
+    malValuePtr lambda;
+    malValueVec args;
+};
+
+class Node : public RefCounted {
+public:
+    Node() : RefCounted(true) { }
+
+    // If tail is non-NULL this may set it and return NULL, in which case
+    // the caller is responsible for making the call.
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const = 0;
+};
+
+typedef RefCountedPtr<Node> NodePtr;
+typedef std::vector<NodePtr> NodeVec;
+
+static void traceNodes(RefTracer& tracer, const NodeVec& nodes)
+{
+    for (auto it = nodes.begin(), end = nodes.end(); it != end; ++it) {
+        tracer(*it);
+    }
+}
+
+class Code : public malCode {
+public:
+    Code(NodePtr body) : malCode(NODES), m_body(body) { }
+
+    virtual malValuePtr execute(malEnvPtr env) const;
+
+    virtual void traceRefs(RefTracer& tracer) const { tracer(m_body); }
+
+private:
+    const NodePtr m_body;
+};
+
+// The frames that will exist when the analysed code runs: the ones being
+// analysed, then those of the environment the fn* is evaluated in.
+typedef malScope Scope;
+
+class Analyzer {
+public:
+    Analyzer();
+
+    NodePtr analyze(malValuePtr form, const Scope& scope, bool isTail) const;
+    malValuePtr analyzeFn(malValuePtr form, malEnvPtr env) const;
+
+private:
+    NodePtr analyzeForm(malValuePtr form, const Scope& scope,
+                        bool isTail) const;
+    NodePtr analyzeCall(const malList* list, const Scope& scope,
+                        bool isTail) const;
+    NodePtr analyzeDef(const malList* list, const Scope& scope) const;
+    NodePtr analyzeDo(const malList* list, const Scope& scope,
+                      bool isTail) const;
+    NodePtr analyzeFn(const malList* list, const Scope& outer) const;
+    NodePtr analyzeIf(const malList* list, const Scope& scope,
+                      bool isTail) const;
+    NodePtr analyzeLet(const malList* list, const Scope& outer,
+                       bool isTail) const;
+    NodePtr analyzeQuasiquote(const malList* list, const Scope& scope,
+                              bool isTail) const;
+    NodePtr analyzeTry(const malList* list, const Scope& scope,
+                       bool isTail) const;
+    NodeVec analyzeItems(const malSequence* seq, int start,
+                         const Scope& scope) const;
+    NodePtr analyzeSymbol(const malSymbol* symbol, const Scope& scope) const;
+
+    const malSymbolId m_catch;
+    const malSymbolId m_debugEval;
+};
+
+static const Analyzer& analyzer()
+{
+    static const Analyzer instance;
+    return instance;
+}
+
+//
+// The executor nodes.
+//
+
+class ConstantNode : public Node {
+public:
+    ConstantNode(malValuePtr value) : m_value(value) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        return m_value;
+    }
+
+    virtual void traceRefs(RefTracer& tracer) const { tracer(m_value); }
+
+private:
+    const malValuePtr m_value;
+};
+
+// Anything the analyser doesn't handle is left to EVAL.
+class EvalNode : public Node {
+public:
+    EvalNode(malValuePtr form) : m_form(form) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        return EVAL(m_form, env);
+    }
+
+    virtual void traceRefs(RefTracer& tracer) const { tracer(m_form); }
+
+private:
+    const malValuePtr m_form;
+};
+
+// Prints the form, as EVAL does, while DEBUG-EVAL is set.
+class TraceNode : public Node {
+public:
+    TraceNode(malValuePtr form, NodePtr node) : m_form(form), m_node(node) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        static const malSymbolId debugEval = mal::symbolId("DEBUG-EVAL");
+        malEnvPtr dbgenv = env->find(debugEval);
+        if (dbgenv && dbgenv->get(debugEval)->isTrue()) {
+            std::cout << "EVAL: " << m_form->print(true) << "\n";
+        }
+        return m_node->exec(env, tail);
+    }
+
+    virtual void traceRefs(RefTracer& tracer) const {
+        tracer(m_form);
+        tracer(m_node);
+    }
+
+private:
+    const malValuePtr m_form;
+    const NodePtr m_node;
+};
+
+class SymbolNode : public Node {
+public:
+    SymbolNode(malSymbolId id) : m_id(id) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        return env->get(m_id);
+    }
+
+protected:
+    const malSymbolId m_id;
+};
+
+class LocalRefNode : public SymbolNode {
+public:
+    LocalRefNode(malSymbolId id, int depth, int slot)
+    : SymbolNode(id), m_depth(depth), m_slot(slot) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        // An empty slot is a def! which hasn't happened yet.
+        const malEnv* frame = env->frameAt(m_depth);
+        if (frame && frame->slot(m_slot)) {
+            return frame->slot(m_slot);
+        }
+        return env->get(m_id);
+    }
+
+private:
+    const int m_depth;
+    const int m_slot;
+};
+
+class GlobalRefNode : public SymbolNode {
+public:
+    GlobalRefNode(malSymbolId id, int depth)
+    : SymbolNode(id), m_depth(depth) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        malEnv* root = env->frameAt(m_depth);
+        return root ? root->get(m_id) : env->get(m_id);
+    }
+
+private:
+    const int m_depth;
+};
+
+class VectorNode : public Node {
+public:
+    VectorNode(const NodeVec& items) : m_items(items) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        std::unique_ptr<malValueVec> items(new malValueVec(m_items.size()));
+        for (int i = 0, n = m_items.size(); i < n; i++) {
+            (*items)[i] = m_items[i]->exec(env, NULL);
+        }
+        return mal::vector(items.release());
+    }
+
+    virtual void traceRefs(RefTracer& tracer) const {
+        traceNodes(tracer, m_items);
+    }
+
+private:
+    const NodeVec m_items;
+};
+
+class DefNode : public Node {
+public:
+    DefNode(malSymbolId id, NodePtr value, bool isMacro)
+    : m_id(id), m_value(value), m_isMacro(isMacro) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        malValuePtr value = m_value->exec(env, NULL);
+        if (m_isMacro) {
+            value = mal::macro(*VALUE_CAST(malLambda, value));
+        }
+        return env->set(m_id, value);
+    }
+
+    virtual void traceRefs(RefTracer& tracer) const { tracer(m_value); }
+
+private:
+    const malSymbolId m_id;
+    const NodePtr m_value;
+    const bool m_isMacro;
+};
+
+class DoNode : public Node {
+public:
+    DoNode(const NodeVec& body) : m_body(body) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        int last = m_body.size() - 1;
+        for (int i = 0; i < last; i++) {
+            m_body[i]->exec(env, NULL);
+        }
+        return m_body[last]->exec(env, tail);
+    }
+
+    virtual void traceRefs(RefTracer& tracer) const {
+        traceNodes(tracer, m_body);
+    }
+
+private:
+    const NodeVec m_body;
+};
+
+class IfNode : public Node {
+public:
+    IfNode(NodePtr test, NodePtr then, NodePtr otherwise)
+    : m_test(test), m_then(then), m_else(otherwise) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        bool isTrue = m_test->exec(env, NULL)->isTrue();
+        return (isTrue ? m_then : m_else)->exec(env, tail);
+    }
+
+    virtual void traceRefs(RefTracer& tracer) const {
+        tracer(m_test);
+        tracer(m_then);
+        tracer(m_else);
+    }
+
+private:
+    const NodePtr m_test;
+    const NodePtr m_then;
+    const NodePtr m_else;
+};
+
+class LambdaNode : public Node {
+public:
+    LambdaNode(const malSymbolIdVec& params, malValuePtr body,
+               malFrameLayoutPtr layout, NodePtr code)
+    : m_params(params), m_body(body), m_layout(layout)
+    , m_code(new Code(code)) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        return mal::lambda(m_params, m_body, env, m_layout, m_code);
+    }
+
+    virtual void traceRefs(RefTracer& tracer) const {
+        tracer(m_body);
+        tracer(m_code);
+    }
+
+private:
+    const malSymbolIdVec m_params;
+    const malValuePtr m_body;
+    const malFrameLayoutPtr m_layout;
+    const malCodePtr m_code;
+};
+
+class LetNode : public Node {
+public:
+    LetNode(malFrameLayoutPtr layout, const std::vector<int>& slots,
+            const NodeVec& values, NodePtr body)
+    : m_layout(layout), m_slots(slots), m_values(values), m_body(body) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        malEnvPtr inner(new malEnv(env, m_layout));
+        for (int i = 0, n = m_slots.size(); i < n; i++) {
+            inner->setSlot(m_slots[i], m_values[i]->exec(inner.ptr(), NULL));
+        }
+        return m_body->exec(inner.ptr(), tail);
+    }
+
+    virtual void traceRefs(RefTracer& tracer) const {
+        traceNodes(tracer, m_values);
+        tracer(m_body);
+    }
+
+private:
+    const malFrameLayoutPtr m_layout;
+    const std::vector<int> m_slots;
+    const NodeVec m_values;
+    const NodePtr m_body;
+};
+
+// The exception is always in slot 0 of the catch* frame.
+class TryNode : public Node {
+public:
+    TryNode(NodePtr body, malFrameLayoutPtr layout, NodePtr handler)
+    : m_body(body), m_layout(layout), m_handler(handler) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        malValuePtr excVal;
+
+        try {
+            return m_body->exec(env, NULL);
+        }
+        catch(String& s) {
+            excVal = mal::string(s);
+        }
+        catch (malEmptyInputException&) {
+            // Not an error, continue as if we got nil
+            return mal::nilValue();
+        }
+        catch(malValuePtr& o) {
+            excVal = o;
+        };
+
+        malEnvPtr inner(new malEnv(env, m_layout));
+        inner->setSlot(0, excVal);
+        return m_handler->exec(inner.ptr(), tail);
+    }
+
+    virtual void traceRefs(RefTracer& tracer) const {
+        tracer(m_body);
+        tracer(m_handler);
+    }
+
+private:
+    const NodePtr m_body;
+    const malFrameLayoutPtr m_layout;
+    const NodePtr m_handler;
+};
+
+// A list whose head isn't a special form. The number of arguments is known,
+// but whether it's a macro call isn't until the head has been evaluated.
+class CallNode : public Node {
+public:
+    CallNode(malValuePtr form, NodePtr op, const NodeVec& args)
+    : m_form(form), m_op(op), m_args(args) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        malValuePtr op = m_op->exec(env, NULL);
+        const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+        if (lambda && lambda->isMacro()) {
+            return expand(op, env, NULL);
+        }
+        malArgs args;
+        evalArgs(env, args.items());
+        return APPLY(op, args.begin(), args.end());
+    }
+
+    virtual void traceRefs(RefTracer& tracer) const {
+        tracer(m_form);
+        tracer(m_op);
+        traceNodes(tracer, m_args);
+        tracer(m_macro);
+        tracer(m_expansion);
+    }
+
+    virtual void clearRefs() {
+        m_macro = NULL;
+        m_expansion = NULL;
+    }
+
+protected:
+    void evalArgs(malEnv* env, malValueVec& args) const {
+        args.reserve(m_args.size());
+        for (int i = 0, n = m_args.size(); i < n; i++) {
+            args.push_back(m_args[i]->exec(env, NULL));
+        }
+    }
+
+    // The expansion is analysed against the frames it will run in, which
+    // are laid out the same way every time this node runs. It's kept for
+    // as long as the head evaluates to the same macro, so redefining the
+    // macro with defmacro! makes the next run expand it again.
+    malValuePtr expand(malValuePtr macro, malEnv* env, TailCall* tail) const {
+        if (macro != m_macro) {
+            const malList* list = STATIC_CAST(malList, m_form);
+            malValuePtr expansion = STATIC_CAST(malLambda, macro)
+                ->apply(list->begin() + 1, list->end());
+            Scope scope(env);
+            m_expansion = analyzer().analyze(expansion, scope, tail != NULL);
+            m_macro = macro;
+        }
+        // The expansion may redefine the macro and run this node again,
+        // which replaces m_expansion while this one is still running.
+        NodePtr expansion = m_expansion;
+        return expansion->exec(env, tail);
+    }
+
+    const malValuePtr m_form;
+    const NodePtr m_op;
+    const NodeVec m_args;
+
+    mutable malValuePtr m_macro;
+    mutable NodePtr m_expansion;
+};
+
+class TailCallNode : public CallNode {
+public:
+    TailCallNode(malValuePtr form, NodePtr op, const NodeVec& args)
+    : CallNode(form, op, args) { }
+
+    virtual malValuePtr exec(malEnv* env, TailCall* tail) const {
+        malValuePtr op = m_op->exec(env, NULL);
+        const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+        if (lambda && lambda->isMacro()) {
+            return expand(op, env, tail);
+        }
+        malArgs args;
+        evalArgs(env, args.items());
+        if (!lambda || !lambda->getCode()) {
+            return APPLY(op, args.begin(), args.end());
+        }
+        tail->lambda = std::move(op);
+        tail->args.swap(args.items());
+        return NULL;
+    }
+};
+
+}
+
+malValuePtr Code::execute(malEnvPtr env) const
+{
+    TailCall tail;
+    malValuePtr lambda; // keeps the running code alive
+    const Code* code = this;
+    while (1) {
+        malValuePtr result = code->m_body->exec(env.ptr(), &tail);
+        if (result) {
+            return result;
+        }
+        lambda = std::move(tail.lambda);
+        const malLambda* next = STATIC_CAST(malLambda, lambda);
+        env = next->makeEnv(tail.args.data(),
+                             tail.args.data() + tail.args.size());
+        code = static_cast<const Code*>(next->getCode());
+    }
+}
+
+//
+// The analyser.
+//
+
+static malSpecialForm specialForm(const malList* list)
+{
+    const malSymbol* head = list->isEmpty()
+        ? NULL : DYNAMIC_CAST(malSymbol, list->item(0));
+    return head ? head->specialForm() : SPECIAL_NONE;
+}
+
+Analyzer::Analyzer()
+: m_catch(mal::symbolId("catch*"))
+, m_debugEval(mal::symbolId("DEBUG-EVAL"))
+{
+
+}
+
+NodePtr Analyzer::analyze(malValuePtr form, const Scope& scope,
+                          bool isTail) const
+{
+    NodePtr node = analyzeForm(form, scope, isTail);
+    if (!node) {
+        return new EvalNode(form);
+    }
+    // Binding DEBUG-EVAL may turn tracing on, so below a frame which binds
+    // it each node traces its form, as EVAL would.
+    if (scope.resolve(m_debugEval).kind == Scope::SLOT) {
+        return new TraceNode(form, node);
+    }
+    return node;
+}
+
+// Returns NULL for a form which is left to EVAL.
+NodePtr Analyzer::analyzeForm(malValuePtr form, const Scope& scope,
+                              bool isTail) const
+{
+    if (form.isImmediate()) {
+        return new ConstantNode(form);
+    }
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, form)) {
+        return analyzeSymbol(symbol, scope);
+    }
+    if (const malVector* vector = DYNAMIC_CAST(malVector, form)) {
+        return new VectorNode(analyzeItems(vector, 0, scope));
+    }
+    if (DYNAMIC_CAST(malHash, form)) {
+        return NULL;
+    }
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (!list || list->isEmpty()) {
+        return new ConstantNode(form);
+    }
+
+    NodePtr node;
+    switch (specialForm(list)) {
+        case SPECIAL_DEF:
+        case SPECIAL_DEFMACRO:
+            node = analyzeDef(list, scope);
+            break;
+
+        case SPECIAL_DO:
+            node = analyzeDo(list, scope, isTail);
+            break;
+
+        case SPECIAL_FN:
+            node = analyzeFn(list, scope);
+            break;
+
+        case SPECIAL_IF:
+            node = analyzeIf(list, scope, isTail);
+            break;
+
+        case SPECIAL_LET:
+            node = analyzeLet(list, scope, isTail);
+            break;
+
+        case SPECIAL_QUASIQUOTE:
+            node = analyzeQuasiquote(list, scope, isTail);
+            break;
+
+        case SPECIAL_QUOTE:
+            if (list->count() == 2) {
+                node = new ConstantNode(list->item(1));
+            }
+            break;
+
+        case SPECIAL_TRY:
+            node = analyzeTry(list, scope, isTail);
+            break;
+
+        case SPECIAL_NONE:
+            node = analyzeCall(list, scope, isTail);
+            break;
+    }
+    return node;
+}
+
+NodePtr Analyzer::analyzeCall(const malList* list, const Scope& scope,
+                              bool isTail) const
+{
+    malValuePtr form(const_cast<malList*>(list));
+    NodePtr op = analyze(list->item(0), scope, false);
+    NodeVec args = analyzeItems(list, 1, scope);
+    if (isTail) {
+        return new TailCallNode(form, op, args);
+    }
+    return new CallNode(form, op, args);
+}
+
+NodePtr Analyzer::analyzeDef(const malList* list, const Scope& scope) const
+{
+    const malSymbol* id = (list->count() == 3)
+        ? DYNAMIC_CAST(malSymbol, list->item(1)) : NULL;
+    if (!id) {
+        return NULL;
+    }
+    bool isMacro = specialForm(list) == SPECIAL_DEFMACRO;
+    return new DefNode(id->id(), analyze(list->item(2), scope, false),
+                       isMacro);
+}
+
+NodePtr Analyzer::analyzeDo(const malList* list, const Scope& scope,
+                            bool isTail) const
+{
+    int count = list->count();
+    if (count < 2) {
+        return NULL;
+    }
+    NodeVec body = analyzeItems(list, 1, scope);
+    body.back() = analyze(list->item(count - 1), scope, isTail);
+    return new DoNode(body);
+}
+
+NodePtr Analyzer::analyzeFn(const malList* list, const Scope& outer) const
+{
+    const malSequence* bindings = (list->count() == 3)
+        ? DYNAMIC_CAST(malSequence, list->item(1)) : NULL;
+    if (!bindings) {
+        return NULL;
+    }
+    malSymbolIdVec params;
+    for (int i = 0; i < bindings->count(); i++) {
+        const malSymbol* param = DYNAMIC_CAST(malSymbol, bindings->item(i));
+        if (!param) {
+            return NULL;
+        }
+        params.push_back(param->id());
+    }
+
+    Scope inner(new malFrameLayout(malFrameLayout::parameters(params),
+                                   list->begin() + 2, list->end()),
+                &outer);
+    NodePtr body = analyze(list->item(2), inner, true);
+    return new LambdaNode(params, list->item(2), inner.layout(), body);
+}
+
+NodePtr Analyzer::analyzeIf(const malList* list, const Scope& scope,
+                            bool isTail) const
+{
+    int count = list->count();
+    if ((count < 3) || (count > 4)) {
+        return NULL;
+    }
+    NodePtr otherwise = (count == 4)
+        ? analyze(list->item(3), scope, isTail)
+        : new ConstantNode(mal::nilValue());
+    return new IfNode(analyze(list->item(1), scope, false),
+                      analyze(list->item(2), scope, isTail),
+                      otherwise);
+}
+
+NodePtr Analyzer::analyzeLet(const malList* list, const Scope& outer,
+                             bool isTail) const
+{
+    const malSequence* bindings = (list->count() == 3)
+        ? DYNAMIC_CAST(malSequence, list->item(1)) : NULL;
+    if (!bindings || (bindings->count() % 2 != 0)) {
+        return NULL;
+    }
+    malSymbolIdVec symbols;
+    for (int i = 0; i < bindings->count(); i += 2) {
+        const malSymbol* var = DYNAMIC_CAST(malSymbol, bindings->item(i));
+        if (!var) {
+            return NULL;
+        }
+        symbols.push_back(var->id());
+    }
+
+    // The values are evaluated in the new frame too.
+    Scope inner(new malFrameLayout(symbols, list->begin() + 1, list->end()),
+                &outer);
+    std::vector<int> slots;
+    NodeVec values;
+    for (int i = 0; i < bindings->count(); i += 2) {
+        malSymbolId id = STATIC_CAST(malSymbol, bindings->item(i))->id();
+        slots.push_back(inner.layout()->slotOf(id));
+        values.push_back(analyze(bindings->item(i + 1), inner, false));
+    }
+    return new LetNode(inner.layout(), slots, values,
+                       analyze(list->item(2), inner, isTail));
+}
+
+NodePtr Analyzer::analyzeQuasiquote(const malList* list, const Scope& scope,
+                                    bool isTail) const
+{
+    if (list->count() != 2) {
+        return NULL;
+    }
+    try {
+        return analyze(expandQuasiquote(list->item(1)), scope, isTail);
+    }
+    catch (String&) {
+        // A malformed unquote, which EVAL will report when it's reached.
+        return NULL;
+    }
+}
+
+NodePtr Analyzer::analyzeTry(const malList* list, const Scope& scope,
+                             bool isTail) const
+{
+    int count = list->count();
+    if (count == 2) {
+        return analyze(list->item(1), scope, isTail);
+    }
+    const malList* handler = (count == 3)
+        ? DYNAMIC_CAST(malList, list->item(2)) : NULL;
+    if (!handler || (handler->count() != 3)) {
+        return NULL;
+    }
+    const malSymbol* catchSym = DYNAMIC_CAST(malSymbol, handler->item(0));
+    const malSymbol* excSym = DYNAMIC_CAST(malSymbol, handler->item(1));
+    if (!catchSym || (catchSym->id() != m_catch) || !excSym) {
+        return NULL;
+    }
+
+    malSymbolIdVec symbols(1, excSym->id());
+    Scope inner(new malFrameLayout(symbols,
+                                   handler->begin() + 2, handler->end()),
+                &scope);
+    return new TryNode(analyze(list->item(1), scope, false),
+                       inner.layout(),
+                       analyze(handler->item(2), inner, isTail));
+}
+
+// Analyses the items from start onwards.
+NodeVec Analyzer::analyzeItems(const malSequence* seq, int start,
+                               const Scope& scope) const
+{
+    NodeVec nodes;
+    for (int i = start; i < seq->count(); i++) {
+        nodes.push_back(analyze(seq->item(i), scope, false));
+    }
+    return nodes;
+}
+
+NodePtr Analyzer::analyzeSymbol(const malSymbol* symbol,
+                                const Scope& scope) const
+{
+    Scope::Ref ref = scope.resolve(symbol->id());
+    switch (ref.kind) {
+        case Scope::SLOT:
+            return new LocalRefNode(symbol->id(), ref.depth, ref.slot);
+
+        case Scope::ROOT:
+            return new GlobalRefNode(symbol->id(), ref.depth);
+
+        case Scope::LOOKUP:
+            break;
+    }
+    return new SymbolNode(symbol->id());
+}
+
+malValuePtr Analyzer::analyzeFn(malValuePtr form, malEnvPtr env) const
+{
+    const malList* list = VALUE_CAST(malList, form);
+
+    // DEBUG-EVAL traces EVAL, so while it's set the body is left to EVAL.
+    malEnvPtr dbgenv = env->find(m_debugEval);
+    bool isTracing = dbgenv && dbgenv->get(m_debugEval)->isTrue();
+
+    if (!isTracing) {
+        NodePtr node = analyzeFn(list, Scope(env));
+        if (node) {
+            return node->exec(env.ptr(), NULL);
+        }
+    }
+
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    malSymbolIdVec params;
+    for (int i = 0; i < bindings->count(); i++) {
+        const malSymbol* sym = VALUE_CAST(malSymbol, bindings->item(i));
+        params.push_back(sym->id());
+    }
+    return mal::lambda(params, list->item(2), env);
+}
+
+malValuePtr analyzeFn(malValuePtr fn, malEnvPtr env)
+{
+    return analyzer().analyzeFn(fn, env);
+}
+
+static bool isSymbol(malValuePtr obj, const String& text)
+{
+    const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
+    return sym && (sym->value() == text);
+}
+
+//  Return arg when ast matches ('sym, arg), else NULL.
+static malValuePtr starts_with(const malValuePtr ast, const char* sym)
+{
+    const malList* list = DYNAMIC_CAST(malList, ast);
+    if (!list || list->isEmpty() || !isSymbol(list->item(0), sym))
+        return NULL;
+    checkArgsIs(sym, 1, list->count() - 1);
+    return list->item(1);
+}
+
+malValuePtr expandQuasiquote(malValuePtr obj)
+{
+    if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj))
+        return mal::list(mal::symbol("quote"), obj);
+
+    const malSequence* seq = DYNAMIC_CAST(malSequence, obj);
+    if (!seq)
+        return obj;
+
+    const malValuePtr unquoted = starts_with(obj, "unquote");
+    if (unquoted)
+        return unquoted;
+
+    malValuePtr res = mal::list(new malValueVec(0));
+    for (int i=seq->count()-1; 0<=i; i--) {
+        const malValuePtr elt     = seq->item(i);
+        const malValuePtr spl_unq = starts_with(elt, "splice-unquote");
+        if (spl_unq)
+            res = mal::list(mal::symbol("concat"), spl_unq, res);
+         else
+            res = mal::list(mal::symbol("cons"), expandQuasiquote(elt), res);
+    }
+    if (DYNAMIC_CAST(malVector, obj))
+        res = mal::list(mal::symbol("vec"), res);
+    return res;
+}
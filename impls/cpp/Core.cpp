@@ -6,6 +6,12 @@
 #include <chrono>
 #include <fstream>
 #include <iostream>
+#include <memory>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <sys/resource.h>
 
 #define CHECK_ARGS_IS(expected) \
     checkArgsIs(name.c_str(), expected, \
@@ -25,6 +31,7 @@ static String printValues(malValueIter begin, malValueIter end,
 static StaticList<malBuiltIn*> handlers;
 
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
+#define INT_ARG(name) int64_t name = integerValue(*argsBegin++)
 
 #define FUNCNAME(uniq) builtIn ## uniq
 #define HRECNAME(uniq) handler ## uniq
@@ -52,19 +59,18 @@ static StaticList<malBuiltIn*> handlers;
 #define BUILTIN_INTOP(op, checkDivByZero) \
     BUILTIN(#op) { \
         CHECK_ARGS_IS(2); \
-        ARG(malInteger, lhs); \
-        ARG(malInteger, rhs); \
+        INT_ARG(lhs); \
+        INT_ARG(rhs); \
         if (checkDivByZero) { \
-            MAL_CHECK(rhs->value() != 0, "Division by zero"); \
+            MAL_CHECK(rhs != 0, "Division by zero"); \
         } \
-        return mal::integer(lhs->value() op rhs->value()); \
+        return mal::integer(lhs op rhs); \
     }
 
 BUILTIN_ISA("atom?",        malAtom);
 BUILTIN_ISA("keyword?",     malKeyword);
 BUILTIN_ISA("list?",        malList);
 BUILTIN_ISA("map?",         malHash);
-BUILTIN_ISA("number?",      malInteger);
 BUILTIN_ISA("sequential?",  malSequence);
 BUILTIN_ISA("string?",      malString);
 BUILTIN_ISA("symbol?",      malSymbol);
@@ -82,56 +88,56 @@ BUILTIN_IS("nil?",          nilValue);
 BUILTIN("-")
 {
     int argCount = CHECK_ARGS_BETWEEN(1, 2);
-    ARG(malInteger, lhs);
+    INT_ARG(lhs);
     if (argCount == 1) {
-        return mal::integer(- lhs->value());
+        return mal::integer(- lhs);
     }
 
-    ARG(malInteger, rhs);
-    return mal::integer(lhs->value() - rhs->value());
+    INT_ARG(rhs);
+    return mal::integer(lhs - rhs);
 }
 
 BUILTIN("<=")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    INT_ARG(lhs);
+    INT_ARG(rhs);
 
-    return mal::boolean(lhs->value() <= rhs->value());
+    return mal::boolean(lhs <= rhs);
 }
 
 BUILTIN(">=")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    INT_ARG(lhs);
+    INT_ARG(rhs);
 
-    return mal::boolean(lhs->value() >= rhs->value());
+    return mal::boolean(lhs >= rhs);
 }
 
 BUILTIN("<")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    INT_ARG(lhs);
+    INT_ARG(rhs);
 
-    return mal::boolean(lhs->value() < rhs->value());
+    return mal::boolean(lhs < rhs);
 }
 
 BUILTIN(">")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    INT_ARG(lhs);
+    INT_ARG(rhs);
 
-    return mal::boolean(lhs->value() > rhs->value());
+    return mal::boolean(lhs > rhs);
 }
 
 BUILTIN("=")
 {
     CHECK_ARGS_IS(2);
-    const malValue* lhs = (*argsBegin++).ptr();
-    const malValue* rhs = (*argsBegin++).ptr();
+    const malValuePtr& lhs = *argsBegin++;
+    const malValuePtr& rhs = *argsBegin++;
 
     return mal::boolean(lhs->isEqualTo(rhs));
 }
@@ -150,7 +156,7 @@ BUILTIN("apply")
         args.push_back(lastArg->item(i));
     }
 
-    return APPLY(op, args.begin(), args.end());
+    return APPLY(op, args.data(), args.data() + args.size());
 }
 
 BUILTIN("assoc")
@@ -170,21 +176,11 @@ BUILTIN("atom")
 
 BUILTIN("concat")
 {
-    int count = 0;
-    for (auto it = argsBegin; it != argsEnd; ++it) {
-        const malSequence* seq = VALUE_CAST(malSequence, *it);
-        count += seq->count();
-    }
-
-    malValueVec* items = new malValueVec(count);
-    int offset = 0;
-    for (auto it = argsBegin; it != argsEnd; ++it) {
-        const malSequence* seq = STATIC_CAST(malSequence, *it);
-        std::copy(seq->begin(), seq->end(), items->begin() + offset);
-        offset += seq->count();
+    if (argsBegin == argsEnd) {
+        return mal::list(new malValueVec(0));
     }
-
-    return mal::list(items);
+    ARG(malSequence, seq);
+    return seq->concat(argsBegin, argsEnd);
 }
 
 BUILTIN("conj")
@@ -201,11 +197,7 @@ BUILTIN("cons")
     malValuePtr first = *argsBegin++;
     ARG(malSequence, rest);
 
-    malValueVec* items = new malValueVec(1 + rest->count());
-    items->at(0) = first;
-    std::copy(rest->begin(), rest->end(), items->begin() + 1);
-
-    return mal::list(items);
+    return rest->cons(first);
 }
 
 BUILTIN("contains?")
@@ -336,13 +328,131 @@ BUILTIN("map")
     ARG(malSequence, source);
 
     const int length = source->count();
-    malValueVec* items = new malValueVec(length);
+    std::unique_ptr<malValueVec> items(new malValueVec(length));
     auto it = source->begin();
     for (int i = 0; i < length; i++) {
       items->at(i) = APPLY(op, it+i, it+i+1);
     }
 
-    return  mal::list(items);
+    return  mal::list(items.release());
+}
+
+// Bytes allocated with malloc and not yet freed, or -1 if the C library
+// can't tell.
+static int64_t heapBytes()
+{
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+    return mallinfo2().uordblks;
+#endif
+#endif
+    return -1;
+}
+
+// The most memory the process has had resident, or -1 if that's unknown.
+static int64_t peakResidentBytes()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return -1;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return int64_t(usage.ru_maxrss) * 1024;
+#endif
+}
+
+// The bytes in use, from malloc, or in blocks from the slabs or the
+// mark-sweep heap.
+static int64_t bytesInUse()
+{
+    int64_t bytes = std::max<int64_t>(heapBytes(), 0);
+#if MARK_SWEEP
+    const MarkSweepHeap::Stats& heap = MarkSweepHeap::stats();
+    bytes += heap.bytesInUse - heap.pageBytes;
+#endif
+#if SLAB_ALLOCATOR
+    for (int i = 0; i < SlabAllocator::ClassCount; i++) {
+        const SlabAllocator::Stats& slab = SlabAllocator::stats(i);
+        bytes += (slab.allocs - slab.frees) * slab.blockSize;
+        bytes -= slab.slabs * SlabAllocator::SlabSize;
+    }
+#endif
+    return bytes;
+}
+
+// Runs the cycle collector, or a mark-sweep collection, and returns the
+// bytes it freed.
+BUILTIN("collect-cycles")
+{
+    CHECK_ARGS_IS(0);
+    int64_t before = bytesInUse();
+#if CYCLE_COLLECTOR
+    CycleCollector::collect();
+#endif
+#if MARK_SWEEP
+    MarkSweepHeap::collect();
+#endif
+    return mal::integer(before - bytesInUse());
+}
+
+// For checking what a change to the value types does to memory use.
+BUILTIN("memory-stats")
+{
+    CHECK_ARGS_IS(0);
+
+    malValueVec sizes = {
+        mal::keyword(":integer"),   mal::integer(sizeof(malInteger)),
+        mal::keyword(":string"),    mal::integer(sizeof(malString)),
+        mal::keyword(":symbol"),    mal::integer(sizeof(malSymbol)),
+        mal::keyword(":list"),      mal::integer(sizeof(malList)),
+        mal::keyword(":items"),     mal::integer(sizeof(malItems)),
+        mal::keyword(":hash-map"),  mal::integer(sizeof(malHash)),
+        mal::keyword(":lambda"),    mal::integer(sizeof(malLambda)),
+        mal::keyword(":atom"),      mal::integer(sizeof(malAtom)),
+    };
+    malValueVec stats = {
+        mal::keyword(":heap-bytes"),    mal::integer(heapBytes()),
+        mal::keyword(":peak-rss-bytes"), mal::integer(peakResidentBytes()),
+        mal::keyword(":region-bytes"),  mal::integer(Region::chunkBytes()),
+        mal::keyword(":value-bytes"),
+            mal::hash(sizes.data(), sizes.data() + sizes.size(), true),
+    };
+#if SLAB_ALLOCATOR
+    // One map for each size class which has been used.
+    malValueVec* slabs = new malValueVec;
+    for (int i = 0; i < SlabAllocator::ClassCount; i++) {
+        const SlabAllocator::Stats& slab = SlabAllocator::stats(i);
+        if (slab.slabs == 0) {
+            continue;
+        }
+        malValueVec slabStats = {
+            mal::keyword(":block-bytes"),   mal::integer(slab.blockSize),
+            mal::keyword(":allocs"),        mal::integer(slab.allocs),
+            mal::keyword(":live"),
+                mal::integer(slab.allocs - slab.frees),
+            mal::keyword(":slab-bytes"),
+                mal::integer(slab.slabs * SlabAllocator::SlabSize),
+        };
+        slabs->push_back(mal::hash(slabStats.data(),
+                                   slabStats.data() + slabStats.size(), true));
+    }
+    stats.push_back(mal::keyword(":slabs"));
+    stats.push_back(mal::list(slabs));
+#endif
+#if MARK_SWEEP
+    const MarkSweepHeap::Stats& heap = MarkSweepHeap::stats();
+    malValueVec heapStats = {
+        mal::keyword(":collections"),   mal::integer(heap.collections),
+        mal::keyword(":block-bytes"),   mal::integer(heap.bytesInUse),
+        mal::keyword(":page-bytes"),    mal::integer(heap.pageBytes),
+    };
+    stats.push_back(mal::keyword(":mark-sweep"));
+    stats.push_back(mal::hash(heapStats.data(),
+                             heapStats.data() + heapStats.size(), true));
+#endif
+    return mal::hash(stats.data(), stats.data() + stats.size(), true);
 }
 
 BUILTIN("meta")
@@ -353,13 +463,18 @@ BUILTIN("meta")
     return obj->meta();
 }
 
+BUILTIN("number?")
+{
+    CHECK_ARGS_IS(1);
+    return mal::boolean(isInteger(*argsBegin));
+}
+
 BUILTIN("nth")
 {
     CHECK_ARGS_IS(2);
     ARG(malSequence, seq);
-    ARG(malInteger,  index);
+    INT_ARG(i);
 
-    int i = index->value();
     MAL_CHECK(i >= 0 && i < seq->count(), "Index out of range");
 
     return seq->item(i);
@@ -423,8 +538,7 @@ BUILTIN("seq")
         return mal::nilValue();
     }
     if (const malSequence* seq = DYNAMIC_CAST(malSequence, arg)) {
-        return seq->isEmpty() ? mal::nilValue()
-                              : mal::list(seq->begin(), seq->end());
+        return seq->isEmpty() ? mal::nilValue() : seq->asList();
     }
     if (const malString* strVal = DYNAMIC_CAST(malString, arg)) {
         const String str = strVal->value();
@@ -477,7 +591,7 @@ BUILTIN("swap!")
     args[0] = atom->deref();
     std::copy(argsBegin, argsEnd, args.begin() + 1);
 
-    malValuePtr value = APPLY(op, args.begin(), args.end());
+    malValuePtr value = APPLY(op, args.data(), args.data() + args.size());
     return atom->reset(value);
 }
 
@@ -517,7 +631,7 @@ BUILTIN("vec")
 {
     CHECK_ARGS_IS(1);
     ARG(malSequence, s);
-    return mal::vector(s->begin(), s->end());
+    return s->asVector();
 }
 
 BUILTIN("vector")
@@ -543,17 +657,18 @@ void installCore(malEnvPtr env) {
 static String printValues(malValueIter begin, malValueIter end,
                           const String& sep, bool readably)
 {
-    String out;
+    Region::Scope scope;
+    RegionString out;
 
     if (begin != end) {
-        out += (*begin)->print(readably);
+        (*begin)->printTo(out, readably);
         ++begin;
     }
 
     for ( ; begin != end; ++begin) {
         out += sep;
-        out += (*begin)->print(readably);
+        (*begin)->printTo(out, readably);
     }
 
-    return out;
+    return String(out.data(), out.size());
 }
@@ -0,0 +1,255 @@
+#include "RefCountedPtr.h"
+
+#if CYCLE_COLLECTOR
+
+#include <algorithm>
+#include <stdint.h>
+
+// Enough possible roots to make tracing from them worthwhile. Objects which
+// are still in use are traced again by every collection that reaches them,
+// so the threshold grows with the number the last one found in use.
+static const size_t MinThreshold = 10000;
+static size_t s_threshold = MinThreshold;
+static size_t s_inUse;
+static bool s_isCollecting;
+const void* CycleCollector::s_deleting;
+
+// What's left in the block of a possible root once it's deleted. It records
+// the size the block has to be freed with.
+class Tombstone : public RefCounted {
+public:
+    Tombstone(size_t size) : m_size(std::min<size_t>(size, UINT16_MAX)) { }
+
+    // Sizes beyond the slab size classes are freed without one.
+    uint16_t m_size;
+};
+static_assert(sizeof(Tombstone) == sizeof(RefCounted),
+              "a tombstone has to fit in the smallest object");
+
+// Never destroyed, as objects may still be released once the program
+// starts to exit.
+static std::vector<const RefCounted*>& roots()
+{
+    static std::vector<const RefCounted*>* roots =
+        new std::vector<const RefCounted*>;
+    return *roots;
+}
+
+void CycleCollector::possibleRoot(const RefCounted* object)
+{
+    if (object->m_isBuffered) {
+        return;
+    }
+    object->m_color = Purple;
+    object->m_isBuffered = true;
+    roots().push_back(object);
+    if ((roots().size() >= s_threshold) && !s_isCollecting && !s_deleting) {
+        collect();
+    }
+}
+
+// Deleting the object at once drops the references it holds, so that values
+// it shared, such as the items of a sequence, can be updated in place again.
+// No collection is started until it's gone.
+void CycleCollector::deleteRoot(const RefCounted* object)
+{
+    const void* outer = s_deleting;
+    s_deleting = object;
+    object->destroy();
+    s_deleting = outer;
+}
+
+void CycleCollector::leaveTombstone(void* ptr, size_t size)
+{
+    new (ptr) Tombstone(size);
+}
+
+size_t CycleCollector::collect()
+{
+    if (s_isCollecting) {
+        return 0;
+    }
+    s_isCollecting = true;
+    s_inUse = 0;
+
+    // Roots found from here on are left for the next collection. Those whose
+    // counts have since dropped to zero are tombstones, whose blocks are
+    // freed at the end.
+    std::vector<const RefCounted*> found;
+    found.swap(roots());
+    Region::Scope scope;
+    Objects candidates, dead, garbage;
+    for (int i = 0, n = found.size(); i < n; i++) {
+        Objects& list = (found[i]->m_refCount > 0) ? candidates : dead;
+        list.push_back(found[i]);
+    }
+
+    for (int i = 0, n = candidates.size(); i < n; i++) {
+        if (candidates[i]->m_color == Purple) {
+            markGray(candidates[i]);
+        }
+    }
+    for (int i = 0, n = candidates.size(); i < n; i++) {
+        scan(candidates[i]);
+    }
+    for (int i = 0, n = candidates.size(); i < n; i++) {
+        candidates[i]->m_isBuffered = false;
+        collectWhite(candidates[i], garbage);
+    }
+
+    // The garbage is held while the references it holds are cleared, and
+    // deleted as the holds are released.
+    for (int i = 0, n = garbage.size(); i < n; i++) {
+        restore(garbage[i]);
+        garbage[i]->acquire();
+    }
+    for (int i = 0, n = garbage.size(); i < n; i++) {
+        const_cast<RefCounted*>(garbage[i])->clearRefs();
+    }
+    for (int i = 0, n = garbage.size(); i < n; i++) {
+        garbage[i]->release();
+    }
+
+    for (int i = 0, n = dead.size(); i < n; i++) {
+        const Tombstone* tombstone = static_cast<const Tombstone*>(dead[i]);
+        size_t size = tombstone->m_size;
+        tombstone->~Tombstone();
+        RefCounted::deallocate(const_cast<Tombstone*>(tombstone), size);
+    }
+
+    s_threshold = std::max(MinThreshold, s_inUse);
+    s_isCollecting = false;
+    return garbage.size();
+}
+
+// The traced objects the object holds references to.
+void CycleCollector::children(const RefCounted* object, Objects& children)
+{
+    class Tracer : public RefTracer {
+    public:
+        Tracer(Objects& children) : m_children(children) { }
+
+        virtual void visit(const RefCounted* child) {
+            if (child->m_color != Green) {
+                m_children.push_back(child);
+            }
+        }
+
+    private:
+        Objects& m_children;
+    };
+
+    children.clear();
+    Tracer tracer(children);
+    object->traceRefs(tracer);
+}
+
+// The traversals keep their own stacks, as the chains of objects can be far
+// longer than the C++ stack allows for. Each gives its stacks back to the
+// Region when it returns, except collectWhite, which adds to the garbage
+// list of the collection as it goes.
+
+// Takes the references among the objects reachable from root off their
+// counts.
+void CycleCollector::markGray(const RefCounted* root)
+{
+    Region::Scope scope;
+    Objects stack(1, root), next;
+    root->m_color = Gray;
+    while (!stack.empty()) {
+        const RefCounted* object = stack.back();
+        stack.pop_back();
+        children(object, next);
+        for (int i = 0, n = next.size(); i < n; i++) {
+            const RefCounted* child = next[i];
+            child->m_refCount--;
+            if (child->m_color != Gray) {
+                child->m_color = Gray;
+                stack.push_back(child);
+            }
+        }
+    }
+}
+
+// Anything still counted is in use, along with everything it refers to. The
+// rest is garbage.
+void CycleCollector::scan(const RefCounted* root)
+{
+    Region::Scope scope;
+    Objects stack(1, root), next;
+    while (!stack.empty()) {
+        const RefCounted* object = stack.back();
+        stack.pop_back();
+        if (object->m_color != Gray) {
+            continue;
+        }
+        if (object->m_refCount > 0) {
+            scanBlack(object);
+            continue;
+        }
+        object->m_color = White;
+        children(object, next);
+        stack.insert(stack.end(), next.begin(), next.end());
+    }
+}
+
+// Puts back the references held by objects in use.
+void CycleCollector::scanBlack(const RefCounted* root)
+{
+    Region::Scope scope;
+    Objects stack(1, root), next;
+    root->m_color = Black;
+    while (!stack.empty()) {
+        const RefCounted* object = stack.back();
+        stack.pop_back();
+        s_inUse++;
+        children(object, next);
+        for (int i = 0, n = next.size(); i < n; i++) {
+            const RefCounted* child = next[i];
+            child->m_refCount++;
+            if (child->m_color != Black) {
+                child->m_color = Black;
+                stack.push_back(child);
+            }
+        }
+    }
+}
+
+// Garbage is turned gray again as it's found, so that it's only found once,
+// and so that it doesn't become a possible root while it's being deleted.
+void CycleCollector::collectWhite(const RefCounted* root, Objects& garbage)
+{
+    Objects stack(1, root), next;
+    while (!stack.empty()) {
+        const RefCounted* object = stack.back();
+        stack.pop_back();
+        if (object->m_color != White) {
+            continue;
+        }
+        object->m_color = Gray;
+        garbage.push_back(object);
+        children(object, next);
+        stack.insert(stack.end(), next.begin(), next.end());
+    }
+}
+
+// Puts back the references held by an object found to be garbage, so that
+// dropping them leaves the counts right.
+void CycleCollector::restore(const RefCounted* object)
+{
+    Region::Scope scope;
+    Objects next;
+    children(object, next);
+    for (int i = 0, n = next.size(); i < n; i++) {
+        next[i]->m_refCount++;
+    }
+}
+
+// Collections once the program's own statics have gone, until there's
+// nothing left to free, so that cycles held by the environment aren't left
+// behind. It's made first so that it's destroyed last.
+static struct CollectAtExit {
+    ~CollectAtExit() { while (CycleCollector::collect() > 0) { } }
+} s_collectAtExit __attribute__((init_priority(101)));
+
+#endif // CYCLE_COLLECTOR
@@ -0,0 +1,65 @@
+#ifndef INCLUDE_CYCLECOLLECTOR_H
+#define INCLUDE_CYCLECOLLECTOR_H
+
+#include "Region.h"
+
+#include <cstddef>
+#include <vector>
+
+class RefCounted;
+
+// Frees the reference cycles that reference counting can't, by trial
+// deletion (Bacon and Rajan, "Concurrent Cycle Collection in Reference
+// Counted Systems", 2001, in its synchronous form).
+//
+// An object whose count drops but not to zero may be what's keeping a cycle
+// alive, so it's kept as a possible root. When there are enough of those,
+// the references among the objects reachable from them are subtracted from
+// their counts. Whatever is left with a count of zero is only referred to
+// from inside the group, and is freed. The counts of the rest are restored.
+//
+// Only objects which can end up in a cycle are traced, see RefCounted.
+// Not thread safe.
+class CycleCollector {
+public:
+    enum Color {
+        Black,  // in use, or not looked at
+        Gray,   // being looked at, or being freed
+        White,  // garbage
+        Purple, // a possible root
+        Green,  // never part of a cycle, so never looked at
+    };
+
+    // Called when the count of a black object which can be part of a cycle
+    // drops but not to zero.
+    static void possibleRoot(const RefCounted* object);
+
+    // Called when the count of a possible root drops to zero. The object is
+    // deleted, but its block stays in the buffer until the next collection,
+    // as a tombstone.
+    static void deleteRoot(const RefCounted* object);
+
+    // Whether the block being freed is the one deleteRoot is deleting.
+    static bool isDeleting(const void* ptr) { return ptr == s_deleting; }
+    static void leaveTombstone(void* ptr, size_t size);
+
+    // Frees the cycles found among the possible roots, and returns how many
+    // objects that freed.
+    static size_t collect();
+
+private:
+    // The work lists of a collection, which it gives back when it's done.
+    typedef std::vector<const RefCounted*,
+                        RegionStlAllocator<const RefCounted*> > Objects;
+
+    static const void* s_deleting;
+
+    static void children(const RefCounted* object, Objects& children);
+    static void markGray(const RefCounted* root);
+    static void scan(const RefCounted* root);
+    static void scanBlack(const RefCounted* root);
+    static void collectWhite(const RefCounted* root, Objects& garbage);
+    static void restore(const RefCounted* object);
+};
+
+#endif // INCLUDE_CYCLECOLLECTOR_H
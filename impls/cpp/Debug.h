@@ -7,6 +7,7 @@
 #define DEBUG_TRACE                    1
 //#define DEBUG_OBJECT_LIFETIMES         1
 //#define DEBUG_ENV_LIFETIMES            1
+//#define DEBUG_REFCOUNT_OPS             1
 
 #define DEBUG_TRACE_FILE    stderr
 
@@ -31,6 +32,25 @@
     #define TRACE_ENV NOTRACE
 #endif
 
+#if DEBUG_REFCOUNT_OPS
+    // Counts every change to a reference count, and prints the total when
+    // the program exits.
+    struct RefCountOps {
+        unsigned long long count;
+        ~RefCountOps() {
+            fprintf(DEBUG_TRACE_FILE, "Reference count changes: %llu\n",
+                    count);
+        }
+    };
+    inline void countRefCountOp() {
+        static RefCountOps ops;
+        ops.count++;
+    }
+    #define COUNT_REFCOUNT_OP() countRefCountOp()
+#else
+    #define COUNT_REFCOUNT_OP() NOOP
+#endif
+
 #define _ASSERT(file, line, condition, ...) \
     if (!(condition)) { \
         printf("Assertion failed at %s(%d): ", file, line); \
@@ -3,21 +3,133 @@
 
 #include <algorithm>
 
-malEnv::malEnv(malEnvPtr outer)
-: m_outer(outer)
+static void addSymbol(malSymbolIdVec& symbols, malSymbolId id)
+{
+    if (std::find(symbols.begin(), symbols.end(), id) == symbols.end()) {
+        symbols.push_back(id);
+    }
+}
+
+// Including the def! targets in nested let* and catch* forms wastes a slot,
+// but is harmless as an empty slot is skipped over.
+static void addDefinitions(malSymbolIdVec& symbols, malValuePtr form)
+{
+    if (form.isImmediate()) {
+        return;
+    }
+    const malSequence* seq = DYNAMIC_CAST(malSequence, form);
+    if (!seq || seq->isEmpty()) {
+        return;
+    }
+    if (const malList* list = DYNAMIC_CAST(malList, form)) {
+        const malSymbol* head = DYNAMIC_CAST(malSymbol, list->item(0));
+        malSpecialForm special = head ? head->specialForm() : SPECIAL_NONE;
+        if ((special == SPECIAL_FN) || (special == SPECIAL_QUOTE)) {
+            return;
+        }
+        if ((special == SPECIAL_DEF) || (special == SPECIAL_DEFMACRO)) {
+            const malSymbol* name = (list->count() > 1)
+                ? DYNAMIC_CAST(malSymbol, list->item(1)) : NULL;
+            if (name) {
+                addSymbol(symbols, name->id());
+            }
+        }
+    }
+    for (int i = 0; i < seq->count(); i++) {
+        addDefinitions(symbols, seq->item(i));
+    }
+}
+
+static malSymbolIdVec withDefinitions(const malSymbolIdVec& bound,
+                                      malValueIter begin, malValueIter end)
+{
+    malSymbolIdVec symbols;
+    for (auto id : bound) {
+        addSymbol(symbols, id);
+    }
+    for (auto it = begin; it != end; ++it) {
+        addDefinitions(symbols, *it);
+    }
+    return symbols;
+}
+
+malFrameLayout::malFrameLayout(const malSymbolIdVec& symbols,
+                               malValueIter formsBegin, malValueIter formsEnd)
+: m_symbols(withDefinitions(symbols, formsBegin, formsEnd))
+{
+
+}
+
+malSymbolIdVec malFrameLayout::parameters(const malSymbolIdVec& bindings)
+{
+    static const malSymbolId ampersand = mal::symbolId("&");
+    malSymbolIdVec symbols;
+    for (auto id : bindings) {
+        if (id != ampersand) {
+            addSymbol(symbols, id);
+        }
+    }
+    return symbols;
+}
+
+malScope::Ref malScope::resolve(malSymbolId symbol) const
+{
+    int depth = 0;
+    const malScope* scope = this;
+    for (; !scope->isRoot(); scope = scope->m_outer, depth++) {
+        int slot = scope->slotOf(symbol);
+        if (slot >= 0) {
+            return Ref { SLOT, depth, slot };
+        }
+    }
+
+    // Frames with a map may gain new names at any time, so the search has
+    // to stop at the first one which has, or may get, a map. This is usually
+    // the root.
+    malEnv* env = m_env.ptr();
+    for (; env && env->layout() && !env->hasMap();
+         env = env->outer(), depth++) {
+        int slot = env->layout()->slotOf(symbol);
+        if (slot >= 0) {
+            return Ref { SLOT, depth, slot };
+        }
+    }
+    if (env && !env->outer()) {
+        return Ref { ROOT, depth, -1 };
+    }
+    return Ref { LOOKUP, depth, -1 };
+}
+
+malEnv::malEnv(const malEnvPtr& outer)
+: RefCounted(true)
+, m_outer(outer)
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
 }
 
-malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
+malEnv::malEnv(const malEnvPtr& outer, const malFrameLayoutPtr& layout)
+: RefCounted(true)
+, m_outer(outer)
+, m_layout(layout)
+, m_slots(layout->slotCount())
+{
+    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+}
+
+malEnv::malEnv(const malEnvPtr& outer, const malFrameLayoutPtr& layout,
+               const malSymbolIdVec& bindings,
                malValueIter argsBegin, malValueIter argsEnd)
-: m_outer(outer)
+: RefCounted(true)
+, m_outer(outer)
+, m_layout(layout)
+, m_slots(layout->slotCount())
 {
     TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    static const malSymbolId ampersand = mal::symbolId("&");
     int n = bindings.size();
     auto it = argsBegin;
     for (int i = 0; i < n; i++) {
-        if (bindings[i] == "&") {
+        if (bindings[i] == ampersand) {
             MAL_CHECK(i == n - 2, "There must be one parameter after the &");
 
             set(bindings[n-1], mal::list(it, argsEnd));
@@ -35,31 +147,70 @@ malEnv::~malEnv()
     TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
 }
 
-malEnvPtr malEnv::find(const String& symbol)
+const malValuePtr* malEnv::lookup(malSymbolId symbol) const
+{
+    if (m_layout) {
+        int slot = m_layout->slotOf(symbol);
+        // An empty slot is a def! which hasn't happened yet.
+        if ((slot >= 0) && m_slots[slot]) {
+            return &m_slots[slot];
+        }
+    }
+    if (m_map) {
+        auto it = m_map->find(symbol);
+        if (it != m_map->end()) {
+            return &it->second;
+        }
+    }
+    return NULL;
+}
+
+malEnvPtr malEnv::find(malSymbolId symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        if (env->m_map.find(symbol) != env->m_map.end()) {
+    for (malEnv* env = this; env; env = env->outer()) {
+        if (env->lookup(symbol)) {
             return env;
         }
     }
     return NULL;
 }
 
-malValuePtr malEnv::get(const String& symbol)
+malEnvPtr malEnv::find(const String& symbol)
+{
+    return find(mal::symbolId(symbol));
+}
+
+malValuePtr malEnv::get(malSymbolId symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        auto it = env->m_map.find(symbol);
-        if (it != env->m_map.end()) {
-            return it->second;
+    for (malEnv* env = this; env; env = env->outer()) {
+        if (const malValuePtr* value = env->lookup(symbol)) {
+            return *value;
         }
     }
-    MAL_FAIL("'%s' not found", symbol.c_str());
+    MAL_FAIL("'%s' not found", mal::symbolName(symbol).c_str());
 }
 
-malValuePtr malEnv::set(const String& symbol, malValuePtr value)
+malValuePtr malEnv::get(const String& symbol)
+{
+    return get(mal::symbolId(symbol));
+}
+
+// Returns the stored value, which lasts as long as the binding does.
+const malValuePtr& malEnv::set(malSymbolId symbol, malValuePtr value)
+{
+    int slot = m_layout ? m_layout->slotOf(symbol) : -1;
+    if (slot >= 0) {
+        return m_slots[slot] = std::move(value);
+    }
+    if (!m_map) {
+        m_map.reset(new Map);
+    }
+    return (*m_map)[symbol] = std::move(value);
+}
+
+const malValuePtr& malEnv::set(const String& symbol, malValuePtr value)
 {
-    m_map[symbol] = value;
-    return value;
+    return set(mal::symbolId(symbol), std::move(value));
 }
 
 malEnvPtr malEnv::getRoot()
@@ -71,3 +222,22 @@ malEnvPtr malEnv::getRoot()
         }
     }
 }
+
+void malEnv::traceRefs(RefTracer& tracer) const
+{
+    tracer(m_outer);
+    for (auto it = m_slots.begin(), end = m_slots.end(); it != end; ++it) {
+        tracer(*it);
+    }
+    if (m_map) {
+        for (auto it = m_map->begin(), end = m_map->end(); it != end; ++it) {
+            tracer(it->second);
+        }
+    }
+}
+
+void malEnv::clearRefs()
+{
+    m_slots.clear();
+    m_map.reset();
+}
@@ -3,27 +3,144 @@
 
 #include "MAL.h"
 
-#include <map>
+#include <memory>
+#include <unordered_map>
+
+// The symbols bound by a frame, in slot order. Every frame created by the
+// same analysed fn*, let* or catch* shares a layout.
+//
+// The rules for laying out frames are kept here, as both the analyser and
+// the VM's compiler follow them.
+class malFrameLayout : public RefCounted {
+public:
+    malFrameLayout(const malSymbolIdVec& symbols) : m_symbols(symbols) { }
+
+    // A frame binding the symbols, once each, in which the forms are
+    // evaluated. The names which the forms may def! follow the symbols, so
+    // that references to them can be resolved in advance.
+    malFrameLayout(const malSymbolIdVec& symbols,
+                   malValueIter formsBegin, malValueIter formsEnd);
+
+    // The symbols which a lambda's parameters bind, without the &.
+    static malSymbolIdVec parameters(const malSymbolIdVec& bindings);
+
+    int slotCount() const { return m_symbols.size(); }
+
+    int slotOf(malSymbolId symbol) const {
+        for (int i = 0, n = m_symbols.size(); i < n; i++) {
+            if (m_symbols[i] == symbol) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+private:
+    const malSymbolIdVec m_symbols;
+};
 
 class malEnv : public RefCounted {
 public:
-    malEnv(malEnvPtr outer = NULL);
-    malEnv(malEnvPtr outer,
-           const StringVec& bindings,
+    malEnv(const malEnvPtr& outer = NULL);
+    malEnv(const malEnvPtr& outer, const malFrameLayoutPtr& layout);
+    malEnv(const malEnvPtr& outer,
+           const malFrameLayoutPtr& layout,
+           const malSymbolIdVec& bindings,
            malValueIter argsBegin,
            malValueIter argsEnd);
 
     ~malEnv();
 
+    malValuePtr get(malSymbolId symbol);
+    malEnvPtr   find(malSymbolId symbol);
+    const malValuePtr& set(malSymbolId symbol, malValuePtr value);
+    malEnvPtr   getRoot();
+
+    // These intern the name first, prefer the malSymbolId versions.
     malValuePtr get(const String& symbol);
     malEnvPtr   find(const String& symbol);
-    malValuePtr set(const String& symbol, malValuePtr value);
-    malEnvPtr   getRoot();
+    const malValuePtr& set(const String& symbol, malValuePtr value);
+
+    // Frames with a layout keep their values in slots. Names which aren't
+    // in the layout, and all names in the root, live in a map.
+    const malFrameLayout* layout() const { return m_layout.ptr(); }
+    bool hasMap() const { return m_map.get() != NULL; }
+    malEnv* outer() const { return m_outer.ptr(); }
+    const malValuePtr& slot(int index) const { return m_slots[index]; }
+
+    // The frame depth levels out, or NULL if one on the way has a map, as
+    // a def! may since have put a name there which hides those further out.
+    malEnv* frameAt(int depth) {
+        malEnv* env = this;
+        for (; depth > 0; depth--) {
+            if (env->hasMap()) {
+                return NULL;
+            }
+            env = env->outer();
+        }
+        return env;
+    }
+    void setSlot(int index, malValuePtr value) {
+        m_slots[index] = std::move(value);
+    }
+
+    // Where this frame keeps the value of a symbol, or NULL. The entries in
+    // the map stay put, so their addresses can be cached.
+    const malValuePtr* lookup(malSymbolId symbol) const;
+
+    virtual void traceRefs(RefTracer& tracer) const;
+    virtual void clearRefs();
+
+private:
+
+    typedef std::unordered_map<malSymbolId, malValuePtr> Map;
+#if SLAB_ALLOCATOR
+    typedef std::vector<malValuePtr, SlabStlAllocator<malValuePtr> > Slots;
+#else
+    typedef malValueVec Slots;
+#endif
+    const malEnvPtr m_outer;
+    const malFrameLayoutPtr m_layout;
+    Slots m_slots;
+    std::unique_ptr<Map> m_map;
+};
+
+// The frames that will exist when code compiled in advance runs: the ones
+// being compiled, then those of the environment it's compiled in, which the
+// outermost scope holds.
+class malScope {
+public:
+    // Where a reference to a name will find it.
+    enum Kind {
+        SLOT,   // in a slot of the frame depth levels out
+        ROOT,   // in the root, depth levels out
+        LOOKUP, // wherever a search by name finds it
+    };
+    struct Ref {
+        Kind kind;
+        int depth;
+        int slot;
+    };
+
+    malScope(malEnvPtr env) : m_outer(NULL), m_env(env) { }
+    malScope(malFrameLayoutPtr layout, const malScope* outer)
+    : m_layout(layout), m_outer(outer), m_env(outer->m_env) { }
+
+    bool isRoot() const { return m_outer == NULL; }
+    malFrameLayoutPtr layout() const { return m_layout; }
+    malEnvPtr env() const { return m_env; }
+
+    // The slot of the symbol in the innermost frame, or -1.
+    int slotOf(malSymbolId symbol) const {
+        return m_layout ? m_layout->slotOf(symbol) : -1;
+    }
+
+    Ref resolve(malSymbolId symbol) const;
 
 private:
-    typedef std::map<String, malValuePtr> Map;
-    Map m_map;
-    malEnvPtr m_outer;
+    const malFrameLayoutPtr m_layout;
+    const malScope* const m_outer;
+    const malEnvPtr m_env;
 };
 
 #endif // INCLUDE_ENVIRONMENT_H
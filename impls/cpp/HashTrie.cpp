@@ -0,0 +1,315 @@
+#include "HashTrie.h"
+#include "Types.h"
+
+typedef HashTrieNode Node;
+
+static bool isSameKey(const malValuePtr& a, const malValuePtr& b)
+{
+    return (a == b) || a->isEqualTo(b);
+}
+
+static uint32_t slotBit(size_t hash, int shift)
+{
+    return uint32_t(1) << ((hash >> shift) & Node::SlotMask);
+}
+
+// The index among the entries or nodes of the one with this bit.
+static int indexOf(uint32_t map, uint32_t bit)
+{
+    return __builtin_popcount(map & (bit - 1));
+}
+
+static bool isCollision(int shift)
+{
+    return shift >= Node::HashBits;
+}
+
+// Nodes are updated in place unless they can be reached from another trie,
+// which is when they, or any node above them, have more than one reference.
+static bool isShared(const Node* node, bool aboveIsShared)
+{
+    return aboveIsShared || node->isShared();
+}
+
+static void noteEntry(Node* node, const HashTrieEntry& entry)
+{
+    node->noteRef(entry.key);
+    node->noteRef(entry.value);
+}
+
+static Node* editable(Node* node, bool shared, int moreEntries, int moreNodes)
+{
+    return shared ? new Node(*node, moreEntries, moreNodes) : node;
+}
+
+// A node for two entries whose hashes agree below shift.
+static Node* makePair(const HashTrieEntry& a, const HashTrieEntry& b,
+                      int shift)
+{
+    Node* node = new Node;
+    noteEntry(node, a);
+    noteEntry(node, b);
+    if (isCollision(shift)) {
+        node->m_entries.push_back(a);
+        node->m_entries.push_back(b);
+        return node;
+    }
+    uint32_t bitA = slotBit(a.hash, shift);
+    uint32_t bitB = slotBit(b.hash, shift);
+    if (bitA == bitB) {
+        node->m_nodeMap = bitA;
+        node->m_nodes.push_back(makePair(a, b, shift + Node::BitsPerLevel));
+        return node;
+    }
+    node->m_entryMap = bitA | bitB;
+    node->m_entries.push_back(bitA < bitB ? a : b);
+    node->m_entries.push_back(bitA < bitB ? b : a);
+    return node;
+}
+
+static const malValuePtr* find(const Node* node, size_t hash,
+                               const malValuePtr& key, int shift)
+{
+    while (node) {
+        if (isCollision(shift)) {
+            for (auto it = node->m_entries.begin(), end = node->m_entries.end();
+                 it != end; ++it) {
+                if (isSameKey(it->key, key)) {
+                    return &it->value;
+                }
+            }
+            return NULL;
+        }
+        uint32_t bit = slotBit(hash, shift);
+        if (node->m_entryMap & bit) {
+            const HashTrieEntry& entry =
+                node->m_entries[indexOf(node->m_entryMap, bit)];
+            return (entry.hash == hash && isSameKey(entry.key, key))
+                ? &entry.value : NULL;
+        }
+        if (!(node->m_nodeMap & bit)) {
+            return NULL;
+        }
+        node = node->m_nodes[indexOf(node->m_nodeMap, bit)].ptr();
+        shift += Node::BitsPerLevel;
+    }
+    return NULL;
+}
+
+// Returns the node with the entry set, which is node itself if nothing
+// changed or it was changed in place. added is set if the key wasn't there
+// before.
+static Node* set(Node* node, const HashTrieEntry& entry, int shift,
+                 bool shared, bool& added)
+{
+    shared = isShared(node, shared);
+    if (isCollision(shift)) {
+        Node* copy = editable(node, shared, 1, 0);
+        noteEntry(copy, entry);
+        for (auto it = copy->m_entries.begin(), end = copy->m_entries.end();
+             it != end; ++it) {
+            if (isSameKey(it->key, entry.key)) {
+                it->value = entry.value;
+                return copy;
+            }
+        }
+        copy->m_entries.push_back(entry);
+        added = true;
+        return copy;
+    }
+
+    uint32_t bit = slotBit(entry.hash, shift);
+    if (node->m_entryMap & bit) {
+        int index = indexOf(node->m_entryMap, bit);
+        const HashTrieEntry& old = node->m_entries[index];
+        if (old.hash == entry.hash && isSameKey(old.key, entry.key)) {
+            if (old.value == entry.value) {
+                return node;
+            }
+            Node* copy = editable(node, shared, 0, 0);
+            copy->noteRef(entry.value);
+            copy->m_entries[index].value = entry.value;
+            return copy;
+        }
+        // Both entries move down into a new child.
+        Node* child = makePair(old, entry, shift + Node::BitsPerLevel);
+        Node* copy = editable(node, shared, 0, 1);
+        noteEntry(copy, entry);
+        copy->m_entries.erase(copy->m_entries.begin() + index);
+        copy->m_entryMap &= ~bit;
+        copy->m_nodeMap |= bit;
+        copy->m_nodes.insert(copy->m_nodes.begin() +
+                             indexOf(copy->m_nodeMap, bit), child);
+        added = true;
+        return copy;
+    }
+    if (node->m_nodeMap & bit) {
+        int index = indexOf(node->m_nodeMap, bit);
+        Node* child = node->m_nodes[index].ptr();
+        Node* newChild = set(child, entry, shift + Node::BitsPerLevel,
+                             shared, added);
+        if (newChild == child) {
+            node->noteRef(node->m_nodes[index]); // it may have been changed
+            return node;
+        }
+        Node* copy = editable(node, shared, 0, 0);
+        copy->m_nodes[index] = newChild;
+        copy->noteRef(copy->m_nodes[index]);
+        return copy;
+    }
+    Node* copy = editable(node, shared, 1, 0);
+    noteEntry(copy, entry);
+    copy->m_entryMap |= bit;
+    copy->m_entries.insert(copy->m_entries.begin() +
+                           indexOf(copy->m_entryMap, bit), entry);
+    added = true;
+    return copy;
+}
+
+// Returns the node without the key, which is node itself if it wasn't there
+// or it was changed in place, or NULL if nothing is left. A child left with
+// a single entry is folded back into its parent, so that removing keys
+// shrinks the trie again.
+static Node* erase(Node* node, size_t hash, const malValuePtr& key, int shift,
+                   bool shared, bool& removed)
+{
+    shared = isShared(node, shared);
+    if (isCollision(shift)) {
+        for (int i = 0, n = node->m_entries.size(); i < n; i++) {
+            if (isSameKey(node->m_entries[i].key, key)) {
+                removed = true;
+                if (n == 1) {
+                    return NULL;
+                }
+                Node* copy = editable(node, shared, 0, 0);
+                copy->m_entries.erase(copy->m_entries.begin() + i);
+                return copy;
+            }
+        }
+        return node;
+    }
+
+    uint32_t bit = slotBit(hash, shift);
+    if (node->m_entryMap & bit) {
+        int index = indexOf(node->m_entryMap, bit);
+        const HashTrieEntry& old = node->m_entries[index];
+        if (old.hash != hash || !isSameKey(old.key, key)) {
+            return node;
+        }
+        removed = true;
+        if ((node->m_entries.size() == 1) && node->m_nodes.empty()) {
+            return NULL;
+        }
+        Node* copy = editable(node, shared, 0, 0);
+        copy->m_entries.erase(copy->m_entries.begin() + index);
+        copy->m_entryMap &= ~bit;
+        return copy;
+    }
+    if (!(node->m_nodeMap & bit)) {
+        return node;
+    }
+
+    int index = indexOf(node->m_nodeMap, bit);
+    Node* child = node->m_nodes[index].ptr();
+    HashTrieNodePtr newChild =
+        erase(child, hash, key, shift + Node::BitsPerLevel, shared, removed);
+    if (!removed) {
+        return node;
+    }
+
+    bool fold = newChild && newChild->m_nodes.empty() &&
+                (newChild->m_entries.size() == 1);
+    if (!newChild || fold) {
+        if (!fold && (node->m_nodes.size() == 1) && node->m_entries.empty()) {
+            return NULL;
+        }
+        Node* copy = editable(node, shared, fold ? 1 : 0, 0);
+        copy->m_nodes.erase(copy->m_nodes.begin() + index);
+        copy->m_nodeMap &= ~bit;
+        if (fold) {
+            noteEntry(copy, newChild->m_entries[0]);
+            copy->m_entryMap |= bit;
+            copy->m_entries.insert(copy->m_entries.begin() +
+                                   indexOf(copy->m_entryMap, bit),
+                                   newChild->m_entries[0]);
+        }
+        return copy;
+    }
+    if (newChild.ptr() == child) {
+        return node;
+    }
+    Node* copy = editable(node, shared, 0, 0);
+    copy->m_nodes[index] = newChild;
+    copy->noteRef(newChild);
+    return copy;
+}
+
+const malValuePtr* HashTrie::find(const malValuePtr& key) const
+{
+    return ::find(m_root.ptr(), hashCode(key), key, 0);
+}
+
+void HashTrie::set(const malValuePtr& key, malValuePtr value)
+{
+    HashTrieEntry entry = { hashCode(key), key, value };
+    if (!m_root) {
+        m_root = new Node;
+    }
+    bool added = false;
+    m_root = ::set(m_root.ptr(), entry, 0, false, added);
+    if (added) {
+        m_count++;
+    }
+}
+
+void HashTrie::erase(const malValuePtr& key)
+{
+    if (!m_root) {
+        return;
+    }
+    bool removed = false;
+    m_root = ::erase(m_root.ptr(), hashCode(key), key, 0, false, removed);
+    if (removed) {
+        m_count--;
+    }
+}
+
+HashTrie::Iterator::Iterator(const HashTrieNode* root)
+: m_depth(-1)
+{
+    if (root) {
+        m_depth = 0;
+        m_stack[0].node = root;
+        m_stack[0].index = 0;
+        settle();
+    }
+}
+
+HashTrie::Iterator& HashTrie::Iterator::operator ++ ()
+{
+    m_stack[m_depth].index++;
+    settle();
+    return *this;
+}
+
+// Moves on from a position past the entries of a node, to the next entry.
+void HashTrie::Iterator::settle()
+{
+    while (m_depth >= 0) {
+        Position& pos = m_stack[m_depth];
+        int entries = pos.node->m_entries.size();
+        if (pos.index < entries) {
+            return;
+        }
+        int child = pos.index - entries;
+        if (child < int(pos.node->m_nodes.size())) {
+            pos.index++;
+            m_depth++;
+            m_stack[m_depth].node = pos.node->m_nodes[child].ptr();
+            m_stack[m_depth].index = 0;
+        }
+        else {
+            m_depth--;
+        }
+    }
+}
@@ -0,0 +1,143 @@
+#ifndef INCLUDE_HASHTRIE_H
+#define INCLUDE_HASHTRIE_H
+
+#include "MAL.h"
+
+#include <stdint.h>
+
+class HashTrieNode;
+typedef RefCountedPtr<HashTrieNode> HashTrieNodePtr;
+
+struct HashTrieEntry {
+    size_t      hash; // of the key, which caches it
+    malValuePtr key;
+    malValuePtr value;
+};
+
+// A persistent hash array mapped trie. Each level of the trie uses five more
+// bits of the key's hash to pick one of 32 slots, which holds either an entry
+// or a child node. Updating copies only the nodes on the path to the entry,
+// so a map and the map it was made from share everything else.
+//
+// Keys can be any values, which are compared with isEqualTo and hashed with
+// hashCode(), so looking a key up doesn't allocate.
+//
+// Entries are kept in the order of their hashes, not of their keys.
+class HashTrie {
+public:
+    HashTrie() : m_count(0) { }
+
+    int size() const { return m_count; }
+
+    // The value stored for key, or NULL.
+    const malValuePtr* find(const malValuePtr& key) const;
+
+    // These replace this trie with the updated one. Copying a trie is cheap,
+    // so persistent updates copy first.
+    void set(const malValuePtr& key, malValuePtr value);
+    void erase(const malValuePtr& key);
+
+    class Iterator;
+    Iterator begin() const;
+    Iterator end() const;
+
+    void traceRefs(RefTracer& tracer) const { tracer(m_root); }
+
+private:
+    HashTrieNodePtr m_root;
+    int m_count;
+};
+
+class HashTrieNode : public RefCounted {
+public:
+    enum {
+        BitsPerLevel = 5,
+        SlotMask = (1 << BitsPerLevel) - 1,
+        HashBits = sizeof(size_t) * 8,
+        MaxDepth = (HashBits + BitsPerLevel - 1) / BitsPerLevel + 1,
+    };
+
+    // Entries are indexed by the bits below theirs in m_entryMap, and child
+    // nodes by the bits in m_nodeMap. Once the hash bits have run out, the
+    // node only holds entries whose hashes collide, unordered.
+    //
+    // Like malItems, a node is only traced by the cycle collector once it
+    // holds something which is, so every change here has to note what it
+    // adds.
+    uint32_t m_entryMap;
+    uint32_t m_nodeMap;
+    std::vector<HashTrieEntry> m_entries;
+    std::vector<HashTrieNodePtr> m_nodes;
+
+    HashTrieNode() : m_entryMap(0), m_nodeMap(0) { }
+
+    // A copy with room for the given number of extra entries and nodes.
+    HashTrieNode(const HashTrieNode& that, int moreEntries, int moreNodes)
+    : RefCounted(that.isTraced())
+    , m_entryMap(that.m_entryMap)
+    , m_nodeMap(that.m_nodeMap)
+    {
+        m_entries.reserve(that.m_entries.size() + moreEntries);
+        m_entries.assign(that.m_entries.begin(), that.m_entries.end());
+        m_nodes.reserve(that.m_nodes.size() + moreNodes);
+        m_nodes.assign(that.m_nodes.begin(), that.m_nodes.end());
+    }
+
+    virtual void traceRefs(RefTracer& tracer) const {
+        for (auto it = m_entries.begin(), end = m_entries.end();
+             it != end; ++it) {
+            tracer(it->key);
+            tracer(it->value);
+        }
+        for (auto it = m_nodes.begin(), end = m_nodes.end(); it != end; ++it) {
+            tracer(*it);
+        }
+    }
+
+private:
+    HashTrieNode(const HashTrieNode&); // no copy ctor
+};
+
+// Visits the entries of each node before those of its children, so the order
+// is fixed for any one trie.
+class HashTrie::Iterator {
+public:
+    Iterator& operator ++ ();
+
+    const HashTrieEntry& operator * () const {
+        return m_stack[m_depth].node->m_entries[m_stack[m_depth].index];
+    }
+    const HashTrieEntry* operator -> () const { return &**this; }
+
+    bool operator != (const Iterator& that) const {
+        return m_depth != that.m_depth ||
+            (m_depth >= 0 && (m_stack[m_depth].node !=
+                              that.m_stack[that.m_depth].node ||
+                              m_stack[m_depth].index !=
+                              that.m_stack[that.m_depth].index));
+    }
+
+private:
+    friend class HashTrie;
+    Iterator(const HashTrieNode* root);
+    void settle();
+
+    struct Position {
+        const HashTrieNode* node;
+        int index; // entries first, then m_entries.size() + child
+    };
+    Position m_stack[HashTrieNode::MaxDepth];
+    int m_depth; // -1 at the end
+};
+
+inline HashTrie::Iterator HashTrie::begin() const
+{
+    return Iterator(m_root.ptr());
+}
+
+inline HashTrie::Iterator HashTrie::end() const
+{
+    return Iterator(NULL);
+}
+
+#endif // INCLUDE_HASHTRIE_H
@@ -9,24 +9,65 @@
 #include <vector>
 
 class malValue;
+class malInteger;
+
+// Integers which fit are stored in the malValuePtr itself, see Types.h.
+template<>
+struct RefCountedImmediate<malValue> {
+    enum { enabled = true };
+    typedef malInteger Object;
+    static malValue* box(intptr_t value);
+};
+
 typedef RefCountedPtr<malValue>  malValuePtr;
 typedef std::vector<malValuePtr> malValueVec;
-typedef malValueVec::iterator    malValueIter;
+// A plain pointer, so that ranges of a vector and of a sequence's slots are
+// passed alike.
+typedef malValuePtr*             malValueIter;
 
 class malEnv;
 typedef RefCountedPtr<malEnv>     malEnvPtr;
 
+class malFrameLayout;
+typedef RefCountedPtr<malFrameLayout> malFrameLayoutPtr;
+
+// Symbols are interned, and identified by their index in the symbol table.
+typedef unsigned int              malSymbolId;
+typedef std::vector<malSymbolId>  malSymbolIdVec;
+
+// The special forms are interned first, in this order, so a symbol's id is
+// also its special form.
+enum malSpecialForm {
+    SPECIAL_DEF,
+    SPECIAL_DEFMACRO,
+    SPECIAL_DO,
+    SPECIAL_FN,
+    SPECIAL_IF,
+    SPECIAL_LET,
+    SPECIAL_QUASIQUOTE,
+    SPECIAL_QUOTE,
+    SPECIAL_TRY,
+    SPECIAL_NONE,
+};
+
 // step*.cpp
-extern malValuePtr APPLY(malValuePtr op,
+extern malValuePtr APPLY(const malValuePtr& op,
                          malValueIter argsBegin, malValueIter argsEnd);
 extern malValuePtr EVAL(malValuePtr ast, malEnvPtr env);
 extern malValuePtr readline(const String& prompt);
 extern String rep(const String& input, malEnvPtr env);
 
+// Analyzer.cpp
+extern malValuePtr analyzeFn(malValuePtr fn, malEnvPtr env);
+extern malValuePtr expandQuasiquote(malValuePtr obj);
+
 // Core.cpp
 extern void installCore(malEnvPtr env);
 
 // Reader.cpp
 extern malValuePtr readStr(const String& input);
 
+// VM.cpp
+extern malValuePtr vmEval(malValuePtr ast, malEnvPtr env);
+
 #endif // INCLUDE_MAL_H
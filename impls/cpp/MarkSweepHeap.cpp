@@ -0,0 +1,597 @@
+#include "RefCountedPtr.h"
+
+#if MARK_SWEEP
+
+#ifndef __GLIBC__
+#error "The roots are found through symbols which glibc defines"
+#endif
+
+#include <algorithm>
+#include <new>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The bounds of the stack and of the program's static data.
+extern "C" {
+    extern void* __libc_stack_end;
+    extern char __data_start[];
+    extern char _end[];
+}
+
+namespace {
+
+enum {
+    PageSize = 64 * 1024,
+    ChunkSize = 16 * PageSize,  // pages are taken this many at a time
+    Granularity = 16,
+    MaxSmall = 8192,            // larger blocks get pages of their own
+    MinThreshold = 4 * 1024 * 1024,
+};
+
+enum Flag {
+    InUse = 1,
+    Marked = 2,
+    Collected = 4,  // freed by the sweep if it isn't marked
+    IsObject = 8,   // destroyed first
+};
+
+const uint16_t sizeClasses[] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+    320, 384, 448, 512, 640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+    2560, 3072, 3584, 4096, 5120, 6144, 7168, 8192,
+};
+const int ClassCount = sizeof(sizeClasses) / sizeof(sizeClasses[0]);
+
+// At the start of every page, followed by a flag byte for each block, then
+// the blocks. A large block's page spans as many 64K regions as it needs.
+struct Page {
+    char* blocks;
+    size_t blockSize;
+    size_t blockCount;
+    size_t size;
+    int sizeClass;  // -1 for a large block
+    Page* prev;     // large blocks only
+    Page* next;
+
+    uint8_t* flags() { return reinterpret_cast<uint8_t*>(this + 1); }
+
+    char* block(size_t index) { return blocks + index * blockSize; }
+    size_t indexOf(const char* ptr) const {
+        return (ptr - blocks) / blockSize;
+    }
+};
+
+struct FreeBlock {
+    FreeBlock* next;
+};
+
+struct Range {
+    char* begin;
+    size_t size;
+};
+
+size_t roundUp(size_t size, size_t to)
+{
+    return (size + to - 1) / to * to;
+}
+
+Page* pageOf(const void* block)
+{
+    return reinterpret_cast<Page*>(
+        reinterpret_cast<uintptr_t>(block) & ~uintptr_t(PageSize - 1));
+}
+
+// Never freed, so that blocks can still be released as the program exits.
+FreeBlock* s_free[ClassCount];
+Page* s_pages[ClassCount];
+Page* s_large;
+Page* s_freePages;
+char* s_chunk;
+char* s_chunkEnd;
+uint8_t s_classOf[MaxSmall / Granularity + 1];
+
+size_t s_allocated;  // since the last collection
+bool s_isCollecting;
+MarkSweepHeap::Stats s_stats = { 0, 0, 0, MinThreshold };
+
+// From the start of each 64K region in use to its page, by open addressing.
+// It's allocated with malloc, so that it isn't scanned. Like the rest of the
+// heap's state, it's all zero to start with, as operator new can be called
+// before any constructor runs.
+class PageTable {
+public:
+    void add(uintptr_t region, Page* page) {
+        if ((m_count + m_removed + 1) * 2 > m_capacity) {
+            grow();
+        }
+        size_t i = slotOf(region);
+        while (m_keys[i] > Removed) {
+            i = (i + 1) & (m_capacity - 1);
+        }
+        if (m_keys[i] == Removed) {
+            m_removed--;
+        }
+        m_keys[i] = region;
+        m_pages[i] = page;
+        m_count++;
+        if (!m_highest || (region < m_lowest)) {
+            m_lowest = region;
+        }
+        m_highest = std::max(m_highest, region + PageSize);
+    }
+
+    void remove(uintptr_t region) {
+        size_t i = slotOf(region);
+        while (m_keys[i] != region) {
+            i = (i + 1) & (m_capacity - 1);
+        }
+        m_keys[i] = Removed;
+        m_count--;
+        m_removed++;
+    }
+
+    Page* find(uintptr_t ptr) const {
+        if ((ptr < m_lowest) || (ptr >= m_highest)) {
+            return NULL;
+        }
+        uintptr_t region = ptr & ~uintptr_t(PageSize - 1);
+        for (size_t i = slotOf(region); m_keys[i] != Empty;
+             i = (i + 1) & (m_capacity - 1)) {
+            if (m_keys[i] == region) {
+                return m_pages[i];
+            }
+        }
+        return NULL;
+    }
+
+private:
+    enum { Empty = 0, Removed = 1 };
+
+    size_t slotOf(uintptr_t region) const {
+        return ((region / PageSize) * 0x9E3779B97F4A7C15ull) >>
+               (64 - m_bits);
+    }
+
+    void grow() {
+        uintptr_t* keys = m_keys;
+        Page** pages = m_pages;
+        size_t capacity = m_capacity;
+        m_bits = std::max(m_bits + (m_count * 4 > capacity ? 1 : 0), 8);
+        m_capacity = size_t(1) << m_bits;
+        m_keys = static_cast<uintptr_t*>(calloc(m_capacity, sizeof(*keys)));
+        m_pages = static_cast<Page**>(malloc(m_capacity * sizeof(*pages)));
+        if (!m_keys || !m_pages) {
+            throw std::bad_alloc();
+        }
+        m_count = m_removed = 0;
+        for (size_t i = 0; i < capacity; i++) {
+            if (keys[i] > Removed) {
+                add(keys[i], pages[i]);
+            }
+        }
+        free(keys);
+        free(pages);
+    }
+
+    uintptr_t* m_keys;
+    Page** m_pages;
+    size_t m_capacity;
+    size_t m_count;
+    size_t m_removed;
+    int m_bits;
+    uintptr_t m_lowest;
+    uintptr_t m_highest;
+} s_pageTable;
+
+// The blocks which have been marked but not yet scanned, allocated with
+// malloc.
+class MarkStack {
+public:
+    void push(char* begin, size_t size) {
+        if (m_size == m_capacity) {
+            m_capacity = std::max<size_t>(m_capacity * 2, 1024);
+            m_ranges = static_cast<Range*>(
+                realloc(m_ranges, m_capacity * sizeof(Range)));
+            if (!m_ranges) {
+                throw std::bad_alloc();
+            }
+        }
+        m_ranges[m_size].begin = begin;
+        m_ranges[m_size].size = size;
+        m_size++;
+    }
+
+    bool empty() const { return m_size == 0; }
+    Range pop() { return m_ranges[--m_size]; }
+
+private:
+    Range* m_ranges;
+    size_t m_size;
+    size_t m_capacity;
+} s_markStack;
+
+void mark(uintptr_t word)
+{
+    Page* page = s_pageTable.find(word);
+    if (!page || (word < uintptr_t(page->blocks))) {
+        return;
+    }
+    size_t index = page->indexOf(reinterpret_cast<char*>(word));
+    if (index >= page->blockCount) {
+        return;
+    }
+    uint8_t& flags = page->flags()[index];
+    if ((flags & InUse) && !(flags & Marked)) {
+        flags |= Marked;
+        s_markStack.push(page->block(index), page->blockSize);
+    }
+}
+
+void markRange(const char* begin, const char* end)
+{
+    const uintptr_t* word = reinterpret_cast<const uintptr_t*>(
+        roundUp(uintptr_t(begin), sizeof(uintptr_t)));
+    for (; reinterpret_cast<const char*>(word + 1) <= end; word++) {
+        mark(*word);
+    }
+}
+
+// Follows the marked blocks until there are none left to scan.
+void markReachable()
+{
+    while (!s_markStack.empty()) {
+        Range range = s_markStack.pop();
+        markRange(range.begin, range.begin + range.size);
+    }
+}
+
+// The callee-saved registers are spilled into this frame, above the local.
+__attribute__((noinline)) void markStack()
+{
+    __builtin_unwind_init();
+    void* volatile top = NULL;
+    markRange(reinterpret_cast<const char*>(const_cast<void**>(&top)),
+              static_cast<const char*>(__libc_stack_end));
+    markReachable();
+}
+
+void initClasses()
+{
+    for (int i = 0, size = 0; i < ClassCount; i++) {
+        for (; size <= sizeClasses[i]; size += Granularity) {
+            s_classOf[size / Granularity] = i;
+        }
+    }
+}
+
+char* newRegion(size_t size)
+{
+    char* region = static_cast<char*>(aligned_alloc(PageSize, size));
+    if (!region) {
+        throw std::bad_alloc();
+    }
+    s_stats.pageBytes += size;
+    return region;
+}
+
+// Threads a page's blocks onto the empty free list of a size class.
+FreeBlock* refill(int sizeClass)
+{
+    Page* page = s_freePages;
+    if (page) {
+        s_freePages = page->next;
+    }
+    else {
+        if (s_chunk == s_chunkEnd) {
+            s_chunk = newRegion(ChunkSize);
+            s_chunkEnd = s_chunk + ChunkSize;
+        }
+        page = reinterpret_cast<Page*>(s_chunk);
+        s_chunk += PageSize;
+    }
+
+    size_t blockSize = sizeClasses[sizeClass];
+    size_t count = (PageSize - sizeof(Page)) / (blockSize + 1);
+    while (roundUp(sizeof(Page) + count, Granularity) + count * blockSize >
+           PageSize) {
+        count--;
+    }
+    page->blocks = reinterpret_cast<char*>(page) +
+                   roundUp(sizeof(Page) + count, Granularity);
+    page->blockSize = blockSize;
+    page->blockCount = count;
+    page->size = PageSize;
+    page->sizeClass = sizeClass;
+    page->next = s_pages[sizeClass];
+    s_pages[sizeClass] = page;
+    memset(page->flags(), 0, count);
+    s_pageTable.add(uintptr_t(page), page);
+
+    FreeBlock* head = NULL;
+    for (size_t i = count; i > 0; i--) {
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(page->block(i - 1));
+        block->next = head;
+        head = block;
+    }
+    s_free[sizeClass] = head;
+    return head;
+}
+
+void* allocateLarge(size_t size, uint8_t flags)
+{
+    size_t header = roundUp(sizeof(Page) + 1, Granularity);
+    size_t regionSize = roundUp(header + size, PageSize);
+    Page* page = reinterpret_cast<Page*>(newRegion(regionSize));
+    page->blocks = reinterpret_cast<char*>(page) + header;
+    page->blockSize = regionSize - header;
+    page->blockCount = 1;
+    page->size = regionSize;
+    page->sizeClass = -1;
+    page->prev = NULL;
+    page->next = s_large;
+    if (s_large) {
+        s_large->prev = page;
+    }
+    s_large = page;
+    page->flags()[0] = flags;
+    for (size_t offset = 0; offset < regionSize; offset += PageSize) {
+        s_pageTable.add(uintptr_t(page) + offset, page);
+    }
+
+    memset(page->blocks, 0, page->blockSize);
+    s_stats.bytesInUse += page->blockSize;
+    s_allocated += page->blockSize;
+    return page->blocks;
+}
+
+void freeLarge(Page* page)
+{
+    for (size_t offset = 0; offset < page->size; offset += PageSize) {
+        s_pageTable.remove(uintptr_t(page) + offset);
+    }
+    (page->prev ? page->prev->next : s_large) = page->next;
+    if (page->next) {
+        page->next->prev = page->prev;
+    }
+    s_stats.bytesInUse -= page->blockSize;
+    s_stats.pageBytes -= page->size;
+    free(page);
+}
+
+// Blocks are handed out zeroed, so that nothing left in them from before
+// keeps other blocks alive. One allocated while the sweep runs destructors
+// is in use, so it's marked.
+void* allocateBlock(size_t size, uint8_t flags)
+{
+    if ((s_allocated >= s_stats.threshold) && !s_isCollecting) {
+        MarkSweepHeap::collect();
+    }
+    if (s_isCollecting) {
+        flags |= Marked;
+    }
+    if (size > MaxSmall) {
+        return allocateLarge(size, flags);
+    }
+    if (s_classOf[MaxSmall / Granularity] == 0) {
+        initClasses();
+    }
+
+    int sizeClass = s_classOf[(size + Granularity - 1) / Granularity];
+    FreeBlock* block = s_free[sizeClass];
+    if (!block) {
+        block = refill(sizeClass);
+    }
+    s_free[sizeClass] = block->next;
+
+    Page* page = pageOf(block);
+    char* ptr = reinterpret_cast<char*>(block);
+    page->flags()[page->indexOf(ptr)] = flags;
+    memset(ptr, 0, page->blockSize);
+    s_stats.bytesInUse += page->blockSize;
+    s_allocated += page->blockSize;
+    return ptr;
+}
+
+// Destroys the objects which weren't reached. Their destructors can release
+// other blocks, but nothing is freed until they've all run.
+void destroyUnmarked(Page* page)
+{
+    uint8_t* flags = page->flags();
+    for (size_t i = 0, n = page->blockCount; i < n; i++) {
+        if ((flags[i] & (IsObject | Marked)) == IsObject) {
+            flags[i] &= ~IsObject;
+            reinterpret_cast<RefCounted*>(page->block(i))->~RefCounted();
+        }
+    }
+}
+
+// Frees the unmarked blocks which are collected, unmarks the rest, and
+// rebuilds the free list. Returns the bytes freed.
+size_t sweep(int sizeClass)
+{
+    size_t freed = 0;
+    FreeBlock* head = NULL;
+    Page** link = &s_pages[sizeClass];
+    while (Page* page = *link) {
+        uint8_t* flags = page->flags();
+        FreeBlock* pageHead = head;
+        bool isEmpty = true;
+        for (size_t i = page->blockCount; i > 0; i--) {
+            uint8_t& blockFlags = flags[i - 1];
+            if (blockFlags & Marked) {
+                blockFlags &= ~Marked;
+            }
+            else if (blockFlags & Collected) {
+                blockFlags = 0;
+                freed += page->blockSize;
+                s_stats.bytesInUse -= page->blockSize;
+            }
+            if (blockFlags & InUse) {
+                isEmpty = false;
+                continue;
+            }
+            FreeBlock* block = reinterpret_cast<FreeBlock*>(page->block(i - 1));
+            block->next = head;
+            head = block;
+        }
+        if (isEmpty) {
+            // Its blocks are taken back off the list, and it's kept for
+            // any size class.
+            head = pageHead;
+            *link = page->next;
+            s_pageTable.remove(uintptr_t(page));
+            page->next = s_freePages;
+            s_freePages = page;
+            continue;
+        }
+        link = &page->next;
+    }
+    s_free[sizeClass] = head;
+    return freed;
+}
+
+} // namespace
+
+void* MarkSweepHeap::allocateObject(size_t size)
+{
+    return allocateBlock(size, InUse | Collected | IsObject);
+}
+
+void* MarkSweepHeap::allocate(size_t size)
+{
+    return allocateBlock(size, InUse);
+}
+
+// A block released while the sweep runs destructors is freed by the sweep,
+// unless something still in use looked as if it pointed to it, in which
+// case it's left to the next collection.
+void MarkSweepHeap::release(void* ptr)
+{
+    if (!ptr) {
+        return;
+    }
+    Page* page = pageOf(ptr);
+    char* block = static_cast<char*>(ptr);
+    uint8_t& flags = page->flags()[page->indexOf(block)];
+    if (s_isCollecting) {
+        flags = (flags & (InUse | Marked)) | Collected;
+        return;
+    }
+    if (page->sizeClass < 0) {
+        freeLarge(page);
+        return;
+    }
+    flags = 0;
+    FreeBlock* freeBlock = static_cast<FreeBlock*>(ptr);
+    freeBlock->next = s_free[page->sizeClass];
+    s_free[page->sizeClass] = freeBlock;
+    s_stats.bytesInUse -= page->blockSize;
+}
+
+size_t MarkSweepHeap::collect()
+{
+    if (s_isCollecting) {
+        return 0;
+    }
+    s_isCollecting = true;
+
+    markRange(__data_start, _end);
+    markReachable();
+    markStack();
+
+    for (int i = 0; i < ClassCount; i++) {
+        for (Page* page = s_pages[i]; page; page = page->next) {
+            destroyUnmarked(page);
+        }
+    }
+    for (Page* page = s_large; page; page = page->next) {
+        destroyUnmarked(page);
+    }
+
+    size_t freed = 0;
+    for (int i = 0; i < ClassCount; i++) {
+        freed += sweep(i);
+    }
+    for (Page* page = s_large, *next; page; page = next) {
+        next = page->next;
+        uint8_t& flags = page->flags()[0];
+        if (flags & Marked) {
+            flags &= ~Marked;
+        }
+        else if (flags & Collected) {
+            freed += page->blockSize;
+            freeLarge(page);
+        }
+    }
+
+    s_stats.collections++;
+    s_stats.threshold = std::max<size_t>(MinThreshold, s_stats.bytesInUse);
+    s_allocated = 0;
+    s_isCollecting = false;
+    return freed;
+}
+
+const MarkSweepHeap::Stats& MarkSweepHeap::stats()
+{
+    return s_stats;
+}
+
+// Everything the program allocates comes from the heap, so that the
+// buffers of standard containers are scanned for the objects they hold.
+void* operator new(size_t size)
+{
+    return MarkSweepHeap::allocate(size);
+}
+
+void* operator new[](size_t size)
+{
+    return MarkSweepHeap::allocate(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    try {
+        return MarkSweepHeap::allocate(size);
+    }
+    catch (const std::bad_alloc&) {
+        return NULL;
+    }
+}
+
+void* operator new[](size_t size, const std::nothrow_t& nothrow) noexcept
+{
+    return operator new(size, nothrow);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    MarkSweepHeap::release(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    MarkSweepHeap::release(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    MarkSweepHeap::release(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    MarkSweepHeap::release(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    MarkSweepHeap::release(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    MarkSweepHeap::release(ptr);
+}
+
+#endif // MARK_SWEEP
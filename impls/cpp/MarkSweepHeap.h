@@ -0,0 +1,45 @@
+#ifndef INCLUDE_MARKSWEEPHEAP_H
+#define INCLUDE_MARKSWEEPHEAP_H
+
+#include <cstddef>
+
+// A heap which frees what the program can no longer reach, in place of
+// reference counting. Built with GC=mark-sweep.
+//
+// Blocks are rounded up to a size class and carved out of 64K pages, each of
+// which starts with a header holding a flag byte per block. Larger blocks get
+// pages of their own. Once enough has been allocated since the last
+// collection, every block which can be reached from the stack, the registers
+// or the program's static data is marked, and the unmarked ones are freed.
+//
+// Roots and blocks are scanned conservatively: any word which looks like a
+// pointer into a block in use keeps that block, as the C++ stack and the
+// buffers of standard containers carry no map of where the pointers are.
+// Reference counted objects are destroyed by the sweep. Other blocks, which
+// the global operator new hands out, are still freed by operator delete, and
+// only scanned. Not thread safe.
+class MarkSweepHeap {
+public:
+    struct Stats {
+        size_t collections;
+        size_t bytesInUse;  // in blocks, which are whole size classes
+        size_t pageBytes;   // taken from the C library
+        size_t threshold;   // allocated between collections
+    };
+
+    // A block for a reference counted object, which is destroyed once it
+    // can't be reached.
+    static void* allocateObject(size_t size);
+
+    // A block which is only freed by release.
+    static void* allocate(size_t size);
+
+    static void release(void* ptr);
+
+    // Returns the bytes it freed.
+    static size_t collect();
+
+    static const Stats& stats();
+};
+
+#endif // INCLUDE_MARKSWEEPHEAP_H
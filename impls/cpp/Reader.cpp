@@ -1,19 +1,75 @@
 #include "MAL.h"
+#include "Region.h"
 #include "Types.h"
 
-#include <regex>
+#include <memory>
+
+#include <stdint.h>
+#include <string.h>
+
+// Character classes used by the tokeniser. These mirror the regexes the
+// reader used to be written in terms of:
+//      whitespace  [\s,]+|;.*
+//      specials    ~@ and [\[\]{}()'`~^@]
+//      strings     "(?:\\.|[^\\"])*"
+//      atoms       [^\s\[\]{}('"`,;)]+
+enum CharClass {
+    CC_WHITESPACE   = 1 << 0,   // skipped, includes ','
+    CC_SPECIAL      = 1 << 1,   // a single character token
+    CC_ATOM_END     = 1 << 2,   // terminates an atom
+    CC_NEWLINE      = 1 << 3,   // terminates a comment, can't be escaped
+};
+
+class CharClassTable
+{
+public:
+    CharClassTable() {
+        memset(m_classes, 0, sizeof(m_classes));
+        add(" \t\n\v\f\r,", CC_WHITESPACE | CC_ATOM_END);
+        add("[]{}()'`~^@", CC_SPECIAL);
+        add("[]{}('\"`,;)", CC_ATOM_END);
+        add("\n\r", CC_NEWLINE);
+    }
 
-typedef std::regex              Regex;
+    bool is(char c, int cls) const {
+        return (m_classes[static_cast<unsigned char>(c)] & cls) != 0;
+    }
 
-static const Regex intRegex("^[-+]?\\d+$");
-static const Regex closeRegex("[\\)\\]}]");
+private:
+    void add(const char* chars, int cls) {
+        for (const char* c = chars; *c; ++c) {
+            m_classes[static_cast<unsigned char>(*c)] |= cls;
+        }
+    }
 
-static const Regex whitespaceRegex("[\\s,]+|;.*");
-static const Regex tokenRegexes[] = {
-    Regex("~@"),
-    Regex("[\\[\\]{}()'`~^@]"),
-    Regex("\"(?:\\\\.|[^\\\\\"])*\""),
-    Regex("[^\\s\\[\\]{}('\"`,;)]+"),
+    unsigned char m_classes[256];
+};
+
+static const CharClassTable charClasses;
+
+// A token is a view into the input string, which must outlive it.
+class Token
+{
+public:
+    Token() : m_begin(NULL), m_end(NULL) { }
+    Token(const char* begin, const char* end) : m_begin(begin), m_end(end) { }
+
+    const char* begin() const { return m_begin; }
+    const char* end()   const { return m_end; }
+    size_t size()       const { return m_end - m_begin; }
+    char operator [] (size_t i) const { return m_begin[i]; }
+
+    bool operator == (const char* text) const {
+        size_t length = strlen(text);
+        return (size() == length) && (memcmp(m_begin, text, length) == 0);
+    }
+    bool operator != (const char* text) const { return !(*this == text); }
+
+    String str() const { return String(m_begin, m_end); }
+
+private:
+    const char* m_begin;
+    const char* m_end;
 };
 
 class Tokeniser
@@ -21,14 +77,14 @@ class Tokeniser
 public:
     Tokeniser(const String& input);
 
-    String peek() const {
+    Token peek() const {
         ASSERT(!eof(), "Tokeniser reading past EOF in peek\n");
         return m_token;
     }
 
-    String next() {
+    Token next() {
         ASSERT(!eof(), "Tokeniser reading past EOF in next\n");
-        String ret = peek();
+        Token ret = peek();
         nextToken();
         return ret;
     }
@@ -41,122 +97,170 @@ private:
     void skipWhitespace();
     void nextToken();
 
-    bool matchRegex(const Regex& regex);
+    const char* scanString(const char* it) const;
 
-    typedef String::const_iterator StringIter;
-
-    String      m_token;
-    StringIter  m_iter;
-    StringIter  m_end;
+    Token       m_token;
+    const char* m_iter;
+    const char* m_end;
 };
 
 Tokeniser::Tokeniser(const String& input)
-:   m_iter(input.begin())
-,   m_end(input.end())
+:   m_token(input.data(), input.data())
+,   m_iter(input.data())
+,   m_end(input.data() + input.size())
 {
     nextToken();
 }
 
-bool Tokeniser::matchRegex(const Regex& regex)
+// Returns the position just past the closing quote of the string starting
+// at it, or NULL if the string isn't terminated.
+const char* Tokeniser::scanString(const char* it) const
 {
-    if (eof()) {
-        return false;
-    }
-
-    std::smatch match;
-    auto flags = std::regex_constants::match_continuous;
-    if (!std::regex_search(m_iter, m_end, match, regex, flags)) {
-        return false;
+    for (++it; it != m_end; ++it) {
+        if (*it == '"') {
+            return it + 1;
+        }
+        if (*it == '\\') {
+            // The escaped character can be anything except a line break.
+            if ((it + 1 == m_end) || charClasses.is(it[1], CC_NEWLINE)) {
+                return NULL;
+            }
+            ++it;
+        }
     }
-
-    ASSERT(match.size() == 1, "Should only have one submatch, not %lu\n",
-                              match.size());
-    ASSERT(match.position(0) == 0, "Need to match first character\n");
-    ASSERT(match.length(0) > 0, "Need to match a non-empty string\n");
-
-    // Don't advance  m_iter now, do it after we've consumed the token in
-    // next().  If we do it now, we hit eof() when there's still one token left.
-    m_token = match.str(0);
-
-    return true;
+    return NULL;
 }
 
 void Tokeniser::nextToken()
 {
-    m_iter += m_token.size();
+    // Don't advance m_iter until we've consumed the token in next().
+    // If we do it now, we hit eof() when there's still one token left.
+    m_iter = m_token.end();
 
     skipWhitespace();
     if (eof()) {
         return;
     }
 
-    for (auto &it : tokenRegexes) {
-        if (matchRegex(it)) {
-            return;
-        }
+    const char* it = m_iter;
+    char c = *it;
+    if ((c == '~') && (it + 1 != m_end) && (it[1] == '@')) {
+        m_token = Token(it, it + 2);
+        return;
     }
-
-    String mismatch(m_iter, m_end);
-    if (mismatch[0] == '"') {
-        MAL_CHECK(false, "expected '\"', got EOF");
+    if (charClasses.is(c, CC_SPECIAL)) {
+        m_token = Token(it, it + 1);
+        return;
+    }
+    if (c == '"') {
+        const char* end = scanString(it);
+        MAL_CHECK(end != NULL, "expected '\"', got EOF");
+        m_token = Token(it, end);
+        return;
     }
-    else {
-        MAL_CHECK(false, "unexpected '%s'", mismatch.c_str());
+    // Anything else which isn't an atom terminator starts an atom.
+    while ((it != m_end) && !charClasses.is(*it, CC_ATOM_END)) {
+        ++it;
     }
+    MAL_CHECK(it != m_iter, "unexpected '%s'", String(m_iter, m_end).c_str());
+    m_token = Token(m_iter, it);
 }
 
 void Tokeniser::skipWhitespace()
 {
-    while (matchRegex(whitespaceRegex)) {
-        m_iter += m_token.size();
+    while (m_iter != m_end) {
+        if (charClasses.is(*m_iter, CC_WHITESPACE)) {
+            ++m_iter;
+        }
+        else if (*m_iter == ';') {
+            while ((m_iter != m_end) && !charClasses.is(*m_iter, CC_NEWLINE)) {
+                ++m_iter;
+            }
+        }
+        else {
+            break;
+        }
     }
 }
 
-static malValuePtr readAtom(Tokeniser& tokeniser);
-static malValuePtr readForm(Tokeniser& tokeniser);
-static void readList(Tokeniser& tokeniser, malValueVec* items,
-                      const String& end);
-static malValuePtr processMacro(Tokeniser& tokeniser, const String& symbol);
+// The items of the lists being read, each list's on top of those of the
+// lists it's in. They're popped once the list has been made from them, so
+// reading a form doesn't allocate a vector for each list in it.
+typedef std::vector<malValuePtr, RegionStlAllocator<malValuePtr> > ReadStack;
 
+static malValuePtr readAtom(Tokeniser& tokeniser, ReadStack& stack);
+static malValuePtr readForm(Tokeniser& tokeniser, ReadStack& stack);
+static malValuePtr processMacro(Tokeniser& tokeniser, ReadStack& stack,
+                                const String& symbol);
+static bool readInteger(const Token& token, int64_t& value);
+
+// The stack is given back to the Region once the form has been read.
 malValuePtr readStr(const String& input)
 {
     Tokeniser tokeniser(input);
     if (tokeniser.eof()) {
         throw malEmptyInputException();
     }
-    return readForm(tokeniser);
+    Region::Scope scope;
+    ReadStack stack;
+    return readForm(tokeniser, stack);
 }
 
-static malValuePtr readForm(Tokeniser& tokeniser)
+class ReadItems {
+public:
+    ReadItems(Tokeniser& tokeniser, ReadStack& stack, const char* end)
+    : m_stack(stack), m_start(stack.size()) {
+        while (1) {
+            MAL_CHECK(!tokeniser.eof(), "expected '%s', got EOF", end);
+            if (tokeniser.peek() == end) {
+                tokeniser.next();
+                return;
+            }
+            m_stack.push_back(readForm(tokeniser, m_stack));
+        }
+    }
+
+    ~ReadItems() { m_stack.resize(m_start); }
+
+    malValueIter begin() const { return m_stack.data() + m_start; }
+    malValueIter end() const { return m_stack.data() + m_stack.size(); }
+
+    // Moves the items out, rather than copying them, so that their counts
+    // don't drop when they're popped.
+    malItemsPtr take() const { return malItems::take(begin(), end()); }
+
+private:
+    ReadStack& m_stack;
+    const size_t m_start;
+};
+
+static malValuePtr readForm(Tokeniser& tokeniser, ReadStack& stack)
 {
     MAL_CHECK(!tokeniser.eof(), "expected form, got EOF");
-    String token = tokeniser.peek();
+    Token token = tokeniser.peek();
 
-    MAL_CHECK(!std::regex_match(token, closeRegex),
-            "unexpected '%s'", token.c_str());
+    MAL_CHECK(token != ")" && token != "]" && token != "}",
+            "unexpected '%s'", token.str().c_str());
 
     if (token == "(") {
         tokeniser.next();
-        std::unique_ptr<malValueVec> items(new malValueVec);
-        readList(tokeniser, items.get(), ")");
-        return mal::list(items.release());
+        ReadItems items(tokeniser, stack, ")");
+        return mal::list(items.take());
     }
     if (token == "[") {
         tokeniser.next();
-        std::unique_ptr<malValueVec> items(new malValueVec);
-        readList(tokeniser, items.get(), "]");
-        return mal::vector(items.release());
+        ReadItems items(tokeniser, stack, "]");
+        return mal::vector(items.take());
     }
     if (token == "{") {
         tokeniser.next();
-        malValueVec items;
-        readList(tokeniser, &items, "}");
+        ReadItems items(tokeniser, stack, "}");
         return mal::hash(items.begin(), items.end(), false);
     }
-    return readAtom(tokeniser);
+    return readAtom(tokeniser, stack);
 }
 
-static malValuePtr readAtom(Tokeniser& tokeniser)
+static malValuePtr readAtom(Tokeniser& tokeniser, ReadStack& stack)
 {
     struct ReaderMacro {
         const char* token;
@@ -180,16 +284,16 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
         { "true",   mal::trueValue()   },
     };
 
-    String token = tokeniser.next();
+    Token token = tokeniser.next();
     if (token[0] == '"') {
-        return mal::string(unescape(token));
+        return mal::string(unescape(token.begin(), token.end()));
     }
     if (token[0] == ':') {
-        return mal::keyword(token);
+        return mal::keyword(token.str());
     }
     if (token == "^") {
-        malValuePtr meta = readForm(tokeniser);
-        malValuePtr value = readForm(tokeniser);
+        malValuePtr meta = readForm(tokeniser, stack);
+        malValuePtr value = readForm(tokeniser, stack);
         // Note that meta and value switch places
         return mal::list(mal::symbol("with-meta"), value, meta);
     }
@@ -200,29 +304,48 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
     }
     for (auto &macro : macroTable) {
         if (token == macro.token) {
-            return processMacro(tokeniser, macro.symbol);
+            return processMacro(tokeniser, stack, macro.symbol);
         }
     }
-    if (std::regex_match(token, intRegex)) {
-        return mal::integer(token);
+    int64_t value;
+    if (readInteger(token, value)) {
+        return mal::integer(value);
     }
-    return mal::symbol(token);
+    return mal::symbol(token.str());
 }
 
-static void readList(Tokeniser& tokeniser, malValueVec* items,
-                      const String& end)
+static malValuePtr processMacro(Tokeniser& tokeniser, ReadStack& stack,
+                                const String& symbol)
 {
-    while (1) {
-        MAL_CHECK(!tokeniser.eof(), "expected '%s', got EOF", end.c_str());
-        if (tokeniser.peek() == end) {
-            tokeniser.next();
-            return;
-        }
-        items->push_back(readForm(tokeniser));
-    }
+    return mal::list(mal::symbol(symbol), readForm(tokeniser, stack));
 }
 
-static malValuePtr processMacro(Tokeniser& tokeniser, const String& symbol)
+// Matches tokens of the form [-+]?[0-9]+
+static bool readInteger(const Token& token, int64_t& value)
 {
-    return mal::list(mal::symbol(symbol), readForm(tokeniser));
+    const char* it = token.begin();
+    const char* end = token.end();
+    bool isNegative = (*it == '-');
+    if ((*it == '-') || (*it == '+')) {
+        ++it;
+    }
+    if (it == end) {
+        return false;
+    }
+
+    uint64_t magnitude = 0;
+    const uint64_t limit = isNegative ? uint64_t(INT64_MAX) + 1 : INT64_MAX;
+    bool inRange = true;
+    for ( ; it != end; ++it) {
+        if ((*it < '0') || (*it > '9')) {
+            return false;
+        }
+        unsigned digit = *it - '0';
+        inRange = inRange && (magnitude <= (limit - digit) / 10);
+        magnitude = magnitude * 10 + digit;
+    }
+    MAL_CHECK(inRange, "'%s' is out of range", token.str().c_str());
+
+    value = isNegative ? int64_t(0 - magnitude) : int64_t(magnitude);
+    return true;
 }
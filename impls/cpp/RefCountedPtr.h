@@ -3,26 +3,222 @@
 
 #include "Debug.h"
 
+#if CYCLE_COLLECTOR
+#include "CycleCollector.h"
+#endif
+#if SLAB_ALLOCATOR
+#include "SlabAllocator.h"
+#endif
+#if MARK_SWEEP
+#include "MarkSweepHeap.h"
+#endif
+
 #include <cstddef>
+#include <new>
+#include <stdint.h>
+#include <type_traits>
+
+class RefTracer;
+template<class T> class RefCountedPtr;
 
 class RefCounted {
 public:
-    RefCounted() : m_refCount(0) { }
+    // Objects which can hold references that lead back to themselves are
+    // traced by the cycle collector.
+#if MARK_SWEEP
+    // Nothing is counted. The heap frees objects which can't be reached.
+    RefCounted(bool isTraced = false) { }
+    virtual ~RefCounted() { }
+
+    const RefCounted* acquire() const { return this; }
+    void release() const { }
+    bool isShared() const { return true; }
+#else
+    RefCounted(bool isTraced = false)
+    : m_refCount(0)
+#if CYCLE_COLLECTOR
+    , m_color(isTraced ? CycleCollector::Black : CycleCollector::Green)
+    , m_isBuffered(false)
+#endif
+    { }
     virtual ~RefCounted() { }
 
-    const RefCounted* acquire() const { m_refCount++; return this; }
-    int release() const { return --m_refCount; }
-    int refCount() const { return m_refCount; }
+    const RefCounted* acquire() const {
+        COUNT_REFCOUNT_OP();
+        m_refCount++;
+        return this;
+    }
+    // Deletes the object once the last reference has gone. A possible root
+    // of a cycle is still in the collector's buffer, which keeps its block.
+    void release() const {
+        COUNT_REFCOUNT_OP();
+        if (--m_refCount == 0) {
+#if CYCLE_COLLECTOR
+            if (m_isBuffered) {
+                CycleCollector::deleteRoot(this);
+                return;
+            }
+#endif
+            destroy();
+        }
+#if CYCLE_COLLECTOR
+        else if ((m_color == CycleCollector::Black) && canBeInCycle()) {
+            CycleCollector::possibleRoot(this);
+        }
+#endif
+    }
+    bool isShared() const { return m_refCount > 1; }
+#endif
+
+#if CYCLE_COLLECTOR
+    bool isTraced() const { return m_color != CycleCollector::Green; }
+#else
+    bool isTraced() const { return false; }
+#endif
+
+    // An object which only refers to untraced objects can't be part of a
+    // cycle either. One which starts out untraced has to note each reference
+    // it takes, so that it's traced once it holds a traced object.
+    template<class T>
+    void noteRef(const RefCountedPtr<T>& ptr) const;
+
+    // Traced objects pass each reference they hold to the tracer.
+    virtual void traceRefs(RefTracer& tracer) const { }
+
+    // False while a traced object can't be part of a cycle, so that it
+    // needn't be a possible root yet.
+    virtual bool canBeInCycle() const { return true; }
+
+    // Drops the references which can change after the object is made. Every
+    // cycle goes through one of them, so doing this to the objects in a
+    // garbage cycle lets them be deleted.
+    virtual void clearRefs() { }
+
+    // Called once the last reference has gone. An object whose block is
+    // larger than its class frees the block itself.
+    virtual void destroy() const { delete this; }
+
+#if SLAB_ALLOCATOR || CYCLE_COLLECTOR || MARK_SWEEP
+    // Deleting through the virtual destructor passes the size of the
+    // object's own class, so the block goes back to the right size class.
+    static void* operator new(size_t size) {
+        return allocate(size);
+    }
+    static void operator delete(void* ptr, size_t size) {
+        deallocate(ptr, size);
+    }
+    static void* operator new(size_t, void* where) { return where; }
+    static void operator delete(void*, void*) { }
+#endif
+
+    static void* allocate(size_t size) {
+#if MARK_SWEEP
+        return MarkSweepHeap::allocateObject(size);
+#elif SLAB_ALLOCATOR
+        return SlabAllocator::allocate(size);
+#else
+        return ::operator new(size);
+#endif
+    }
+    // The block of a possible root being deleted becomes a tombstone.
+    static void deallocate(void* ptr, size_t size) {
+#if CYCLE_COLLECTOR
+        if (CycleCollector::isDeleting(ptr)) {
+            CycleCollector::leaveTombstone(ptr, size);
+            return;
+        }
+#endif
+#if MARK_SWEEP
+        MarkSweepHeap::release(ptr);
+#elif SLAB_ALLOCATOR
+        SlabAllocator::release(ptr, size);
+#else
+        ::operator delete(ptr);
+#endif
+    }
 
 private:
     RefCounted(const RefCounted&); // no copy ctor
     RefCounted& operator = (const RefCounted&); // no assignments
 
+#if !MARK_SWEEP
     mutable int m_refCount;
+#endif
+#if CYCLE_COLLECTOR
+    // These fit in the padding after the reference count.
+    friend class CycleCollector;
+    mutable uint8_t m_color;
+    mutable bool m_isBuffered; // among the possible roots
+#endif
+};
+
+// A type can opt in to storing small integers directly in the pointer word
+// by specialising this. The specialisation names the Object type used when
+// an object is needed, which must derive from T and be constructible from an
+// intptr_t, and box() which allocates one.
+template<class T>
+struct RefCountedImmediate {
+    enum { enabled = false };
+    static T* box(intptr_t value) { return NULL; }
+};
+
+template<class T, bool hasImmediates = RefCountedImmediate<T>::enabled>
+class RefCountedArrow {
+public:
+    RefCountedArrow(T* object) : m_object(object) { }
+    RefCountedArrow(intptr_t) : m_object(NULL) { } // there are no immediates
+
+    T* operator -> () const { return m_object; }
+
+private:
+    T* m_object;
+};
+
+// When operator -> is used on an immediate, a temporary Object is built
+// on the stack and lives until the end of the full expression.
+template<class T>
+class RefCountedArrow<T, true> {
+    typedef typename RefCountedImmediate<T>::Object Object;
+
+public:
+    RefCountedArrow(T* object) : m_object(object), m_isTemporary(false) { }
+
+    RefCountedArrow(intptr_t value) : m_isTemporary(true), m_value(value) {
+        m_object = new (&m_storage) Object(value);
+    }
+
+    RefCountedArrow(const RefCountedArrow& that)
+    : m_object(that.m_object)
+    , m_isTemporary(that.m_isTemporary)
+    , m_value(that.m_value)
+    {
+        if (m_isTemporary) {
+            m_object = new (&m_storage) Object(m_value);
+        }
+    }
+
+    ~RefCountedArrow() {
+        if (m_isTemporary) {
+            static_cast<Object*>(m_object)->~Object();
+        }
+    }
+
+    T* operator -> () const { return m_object; }
+
+private:
+    RefCountedArrow& operator = (const RefCountedArrow&); // no assignments
+
+    T* m_object;
+    bool m_isTemporary;
+    intptr_t m_value;
+    typename std::aligned_storage<sizeof(Object),
+                                  alignof(Object)>::type m_storage;
 };
 
 template<class T>
 class RefCountedPtr {
+    typedef RefCountedImmediate<T> Immediate;
+
 public:
     RefCountedPtr() : m_object(0) { }
 
@@ -32,11 +228,25 @@ public:
     RefCountedPtr(const RefCountedPtr& rhs) : m_object(0)
     { acquire(rhs.m_object); }
 
+    // Moving takes over the reference, so the count doesn't change.
+    RefCountedPtr(RefCountedPtr&& rhs) noexcept : m_object(rhs.m_object)
+    { rhs.m_object = 0; }
+
     const RefCountedPtr& operator = (const RefCountedPtr& rhs) {
         acquire(rhs.m_object);
         return *this;
     }
 
+    // The reference is taken before the old one is dropped, as dropping it
+    // could destroy the object which holds rhs.
+    const RefCountedPtr& operator = (RefCountedPtr&& rhs) noexcept {
+        T* object = rhs.m_object;
+        rhs.m_object = 0;
+        release();
+        m_object = object;
+        return *this;
+    }
+
     bool operator == (const RefCountedPtr& rhs) const {
         return m_object == rhs.m_object;
     }
@@ -53,25 +263,113 @@ public:
         release();
     }
 
-    T* operator -> () const { return m_object; }
-    T* ptr() const { return m_object; }
+    RefCountedArrow<T> operator -> () const {
+        if (isImmediate()) {
+            return RefCountedArrow<T>(immediateValue());
+        }
+        return RefCountedArrow<T>(m_object);
+    }
+
+    // Without boxing an immediate.
+    bool isTraced() const { return isObject(m_object) && m_object->isTraced(); }
+
+    // Immediates are boxed in place when a real pointer is needed.
+    T* ptr() const {
+        if (isImmediate()) {
+            box();
+        }
+        return m_object;
+    }
+
+    // Immediates use the bottom two bits as a tag, which are always clear
+    // in object pointers.
+    static bool canHoldImmediate(intmax_t value) {
+        const intmax_t limit = intmax_t(1) << (ImmediateBits - 1);
+        return Immediate::enabled && (value >= -limit) && (value < limit);
+    }
+
+    static RefCountedPtr immediate(intptr_t value) {
+        ASSERT(canHoldImmediate(value), "%jd can't be an immediate\n",
+               intmax_t(value));
+        RefCountedPtr ptr;
+        ptr.m_object = reinterpret_cast<T*>(
+            (uintptr_t(value) << TagBits) | ImmediateTag);
+        return ptr;
+    }
+
+    bool isImmediate() const {
+        return Immediate::enabled && isTagged(m_object);
+    }
+
+    intptr_t immediateValue() const {
+        return intptr_t(reinterpret_cast<uintptr_t>(m_object)) >> TagBits;
+    }
 
 private:
+    enum {
+        TagBits = 2,
+        TagMask = (1 << TagBits) - 1,
+        ImmediateTag = 1,
+        ImmediateBits = sizeof(intptr_t) * 8 - TagBits,
+    };
+
+    static bool isTagged(T* object) {
+        return (reinterpret_cast<uintptr_t>(object) & TagMask) == ImmediateTag;
+    }
+
+    static bool isObject(T* object) {
+        return (object != NULL) && !(Immediate::enabled && isTagged(object));
+    }
+
+    void box() const {
+        T* object = Immediate::box(immediateValue());
+        object->acquire();
+        m_object = object;
+    }
+
     void acquire(T* object) {
-        if (object != NULL) {
+        if (isObject(object)) {
             object->acquire();
         }
         release();
         m_object = object;
     }
 
+    // The pointer is cleared first, so that the cycle collector, which may
+    // run during the release, doesn't find a reference that's been dropped.
     void release() {
-        if ((m_object != NULL) && (m_object->release() == 0)) {
-            delete m_object;
+        T* object = m_object;
+        m_object = 0;
+        if (isObject(object)) {
+            object->release();
         }
     }
 
-    T* m_object;
+    friend class RefTracer;
+    mutable T* m_object;
+};
+
+template<class T>
+inline void RefCounted::noteRef(const RefCountedPtr<T>& ptr) const
+{
+#if CYCLE_COLLECTOR
+    if ((m_color == CycleCollector::Green) && ptr.isTraced()) {
+        m_color = CycleCollector::Black;
+    }
+#endif
+}
+
+// Passed to RefCounted::traceRefs.
+class RefTracer {
+public:
+    template<class T>
+    void operator () (const RefCountedPtr<T>& ptr) {
+        if (RefCountedPtr<T>::isObject(ptr.m_object)) {
+            visit(ptr.m_object);
+        }
+    }
+
+    virtual void visit(const RefCounted* object) = 0;
 };
 
 #endif // INCLUDE_REFCOUNTEDPTR_H
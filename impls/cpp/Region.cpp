@@ -0,0 +1,30 @@
+#include "Region.h"
+
+Region::Chunk* Region::s_head = NULL;
+Region::Chunk* Region::s_chunk = NULL;
+char* Region::s_top = NULL;
+char* Region::s_end = NULL;
+size_t Region::s_chunkBytes = 0;
+
+// Moves on to the chunk after the current one, making it if need be.
+void* Region::refill(size_t size)
+{
+    static_assert(sizeof(Chunk) % Granularity == 0,
+                  "the blocks after a chunk's header must be aligned");
+    static_assert(sizeof(Chunk) + MaxSize <= ChunkSize,
+                  "the largest block must fit in a chunk");
+
+    Chunk* chunk = s_chunk ? s_chunk->next : s_head;
+    if (!chunk) {
+        chunk = static_cast<Chunk*>(::operator new(ChunkSize));
+        chunk->next = NULL;
+        chunk->end = reinterpret_cast<char*>(chunk) + ChunkSize;
+        s_chunkBytes += ChunkSize;
+        (s_chunk ? s_chunk->next : s_head) = chunk;
+    }
+
+    s_chunk = chunk;
+    s_top = chunk->data() + size;
+    s_end = chunk->end;
+    return chunk->data();
+}
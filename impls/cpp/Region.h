@@ -0,0 +1,118 @@
+#ifndef INCLUDE_REGION_H
+#define INCLUDE_REGION_H
+
+#include <cstddef>
+#include <new>
+
+// Scratch memory for what a top level form makes and drops again before
+// its result is returned: the lists the reader builds, the text the printer
+// builds, and the work lists of the cycle collector. Blocks are bumped off
+// the end of 64K chunks, and everything taken within a Scope is given back
+// at once when it ends, leaving the chunks for the next Scope. rep() opens a
+// Scope around each form, and each read, print and collection opens one of
+// its own, so that running them many times in one form doesn't keep what
+// the earlier runs used. Freeing the last block taken gives it back at once;
+// other frees wait for the end of the Scope. Chunks are never given back.
+// Without the slab allocator, every block comes from ::operator new, so that
+// the sanitizer sees each one. Not thread safe.
+class Region {
+    struct Chunk {
+        Chunk* next;
+        char* end;
+
+        char* data() { return reinterpret_cast<char*>(this + 1); }
+    };
+
+public:
+    enum {
+        Granularity = 16,
+#if SLAB_ALLOCATOR
+        MaxSize = 16 * 1024,    // larger blocks use ::operator new
+#else
+        MaxSize = 0,
+#endif
+        ChunkSize = 64 * 1024,
+    };
+
+    class Scope {
+    public:
+        Scope() : m_chunk(s_chunk), m_top(s_top) { }
+        ~Scope() {
+            s_chunk = m_chunk;
+            s_top = m_top;
+            s_end = m_chunk ? m_chunk->end : NULL;
+        }
+
+    private:
+        Scope(const Scope&);
+        Scope& operator = (const Scope&);
+
+        Chunk* const m_chunk;
+        char* const m_top;
+    };
+
+    static void* allocate(size_t size) {
+        if (size > MaxSize) {
+            return ::operator new(size);
+        }
+        size = roundUp(size);
+        if (size > size_t(s_end - s_top)) {
+            return refill(size);
+        }
+        void* ptr = s_top;
+        s_top += size;
+        return ptr;
+    }
+
+    static void release(void* ptr, size_t size) {
+        if (size > MaxSize) {
+            ::operator delete(ptr);
+            return;
+        }
+        char* block = static_cast<char*>(ptr);
+        if ((block + roundUp(size) == s_top) && (block >= s_chunk->data())) {
+            s_top = block;
+        }
+    }
+
+    // The bytes in chunks.
+    static size_t chunkBytes() { return s_chunkBytes; }
+
+private:
+    static size_t roundUp(size_t size) {
+        return (size + Granularity - 1) & ~size_t(Granularity - 1);
+    }
+
+    static void* refill(size_t size);
+
+    static Chunk* s_head;
+    static Chunk* s_chunk;
+    static char* s_top;
+    static char* s_end;
+    static size_t s_chunkBytes;
+};
+
+// For the buffers of standard containers which live within a Scope.
+template<class T>
+class RegionStlAllocator {
+public:
+    typedef T value_type;
+
+    RegionStlAllocator() { }
+    template<class U>
+    RegionStlAllocator(const RegionStlAllocator<U>&) { }
+
+    T* allocate(size_t count) {
+        return static_cast<T*>(Region::allocate(count * sizeof(T)));
+    }
+    void deallocate(T* ptr, size_t count) {
+        Region::release(ptr, count * sizeof(T));
+    }
+
+    template<class U>
+    bool operator == (const RegionStlAllocator<U>&) const { return true; }
+    template<class U>
+    bool operator != (const RegionStlAllocator<U>&) const { return false; }
+};
+
+#endif // INCLUDE_REGION_H
@@ -0,0 +1,29 @@
+#include "SlabAllocator.h"
+
+#include <stdlib.h>
+
+SlabAllocator::SizeClass SlabAllocator::s_classes[ClassCount];
+
+// Threads a new slab's blocks onto the empty free list of a size class.
+SlabAllocator::Block* SlabAllocator::refill(int index)
+{
+    size_t blockSize = (index + 1) * Granularity;
+    char* slab = static_cast<char*>(malloc(SlabSize));
+    if (!slab) {
+        throw std::bad_alloc();
+    }
+
+    SizeClass& sizeClass = s_classes[index];
+    sizeClass.stats.blockSize = blockSize;
+    sizeClass.stats.slabs++;
+
+    Block* head = NULL;
+    for (size_t offset = SlabSize - SlabSize % blockSize; offset > 0; ) {
+        offset -= blockSize;
+        Block* block = reinterpret_cast<Block*>(slab + offset);
+        block->next = head;
+        head = block;
+    }
+    sizeClass.free = head;
+    return head;
+}
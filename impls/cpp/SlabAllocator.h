@@ -0,0 +1,97 @@
+#ifndef INCLUDE_SLABALLOCATOR_H
+#define INCLUDE_SLABALLOCATOR_H
+
+#include <cstddef>
+#include <new>
+
+// Small blocks, rounded up to a size class, carved out of large slabs. Each
+// size class keeps the blocks freed from it on a list, so once a program has
+// warmed up, allocating and freeing a block is a couple of pointer moves.
+// Slabs are never given back. Not thread safe.
+class SlabAllocator {
+public:
+    enum {
+        Granularity = 16,
+        ClassCount = 16,
+        MaxSize = Granularity * ClassCount, // larger blocks use ::operator new
+        SlabSize = 64 * 1024,
+    };
+
+    struct Stats {
+        size_t blockSize;
+        size_t allocs;
+        size_t frees;
+        size_t slabs;
+    };
+
+    static void* allocate(size_t size) {
+        if (size > MaxSize) {
+            return ::operator new(size);
+        }
+        SizeClass& sizeClass = s_classes[classOf(size)];
+        sizeClass.stats.allocs++;
+        Block* block = sizeClass.free;
+        if (!block) {
+            block = refill(classOf(size));
+        }
+        sizeClass.free = block->next;
+        return block;
+    }
+
+    static void release(void* ptr, size_t size) {
+        if (size > MaxSize) {
+            ::operator delete(ptr);
+            return;
+        }
+        SizeClass& sizeClass = s_classes[classOf(size)];
+        sizeClass.stats.frees++;
+        Block* block = static_cast<Block*>(ptr);
+        block->next = sizeClass.free;
+        sizeClass.free = block;
+    }
+
+    static const Stats& stats(int index) { return s_classes[index].stats; }
+
+private:
+    struct Block {
+        Block* next;
+    };
+
+    struct SizeClass {
+        Block* free;
+        Stats stats;
+    };
+
+    static int classOf(size_t size) {
+        return (size - 1) / Granularity;
+    }
+
+    static Block* refill(int index);
+
+    static SizeClass s_classes[ClassCount];
+};
+
+// For the buffers of standard containers.
+template<class T>
+class SlabStlAllocator {
+public:
+    typedef T value_type;
+
+    SlabStlAllocator() { }
+    template<class U>
+    SlabStlAllocator(const SlabStlAllocator<U>&) { }
+
+    T* allocate(size_t count) {
+        return static_cast<T*>(SlabAllocator::allocate(count * sizeof(T)));
+    }
+    void deallocate(T* ptr, size_t count) {
+        SlabAllocator::release(ptr, count * sizeof(T));
+    }
+
+    template<class U>
+    bool operator == (const SlabStlAllocator<U>&) const { return true; }
+    template<class U>
+    bool operator != (const SlabStlAllocator<U>&) const { return false; }
+};
+
+#endif // INCLUDE_SLABALLOCATOR_H
@@ -35,10 +35,9 @@ String copyAndFree(char* mallocedString)
     return ret;
 }
 
-String escape(const String& in)
+template<class Out>
+static void escapeTo(Out& out, const String& in)
 {
-    String out;
-    out.reserve(in.size() * 2 + 2); // each char may get escaped + two "'s
     out += '"';
     for (auto it = in.begin(), end = in.end(); it != end; ++it) {
         char c = *it;
@@ -50,10 +49,22 @@ String escape(const String& in)
         };
     }
     out += '"';
+}
+
+String escape(const String& in)
+{
+    String out;
+    out.reserve(in.size() * 2 + 2); // each char may get escaped + two "'s
+    escapeTo(out, in);
     out.shrink_to_fit();
     return out;
 }
 
+void escape(RegionString& out, const String& in)
+{
+    escapeTo(out, in);
+}
+
 static char unescape(char c)
 {
     switch (c) {
@@ -65,16 +76,21 @@ static char unescape(char c)
 }
 
 String unescape(const String& in)
+{
+    return unescape(in.data(), in.data() + in.size());
+}
+
+String unescape(const char* begin, const char* end)
 {
     String out;
-    out.reserve(in.size()); // unescaped string will always be shorter
+    out.reserve(end - begin); // unescaped string will always be shorter
 
     // in will have double-quotes at either end, so move the iterators in
-    for (auto it = in.begin()+1, end = in.end()-1; it != end; ++it) {
+    for (auto it = begin+1, last = end-1; it != last; ++it) {
         char c = *it;
         if (c == '\\') {
             ++it;
-            if (it != end) {
+            if (it != last) {
                 out += unescape(*it);
             }
         }
@@ -1,18 +1,31 @@
 #ifndef INCLUDE_STRING_H
 #define INCLUDE_STRING_H
 
+#include "Region.h"
+
 #include <string>
 #include <vector>
 
 typedef std::string         String;
 typedef std::vector<String> StringVec;
 
+// Text built up in the Region, such as what the printer writes.
+typedef std::basic_string<char, std::char_traits<char>,
+                          RegionStlAllocator<char> > RegionString;
+
+inline RegionString& operator += (RegionString& out, const String& s)
+{
+    return out.append(s.data(), s.size());
+}
+
 #define STRF        stringPrintf
 #define PLURAL(n)   &("s"[(n)==1])
 
 extern String stringPrintf(const char* fmt, ...);
 extern String copyAndFree(char* mallocedString);
 extern String escape(const String& s);
+extern void escape(RegionString& out, const String& s);
 extern String unescape(const String& s);
+extern String unescape(const char* begin, const char* end);
 
 #endif // INCLUDE_STRING_H
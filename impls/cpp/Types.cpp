@@ -3,8 +3,50 @@
 #include "Types.h"
 
 #include <algorithm>
+#include <functional>
 #include <memory>
-#include <typeinfo>
+#include <unordered_map>
+
+// All symbols with the same name share one malSymbol, and so one id.
+// Symbols are never freed.
+class malSymbolTable {
+public:
+    malSymbolTable() {
+        static const char* specialForms[SPECIAL_NONE] = {
+            "def!", "defmacro!", "do", "fn*", "if", "let*",
+            "quasiquote", "quote", "try*",
+        };
+        for (auto name : specialForms) {
+            intern(name);
+        }
+    }
+
+    malValuePtr intern(const String& name) {
+        auto it = m_ids.find(name);
+        if (it != m_ids.end()) {
+            return m_symbols[it->second];
+        }
+
+        malSymbolId id = m_symbols.size();
+        m_symbols.push_back(new malSymbol(name, id));
+        m_ids[name] = id;
+        return m_symbols.back();
+    }
+
+    const String& name(malSymbolId id) const {
+        return STATIC_CAST(malSymbol, m_symbols[id])->value();
+    }
+
+private:
+    std::unordered_map<String, malSymbolId> m_ids;
+    malValueVec m_symbols;
+};
+
+static malSymbolTable& symbolTable()
+{
+    static malSymbolTable table;
+    return table;
+}
 
 namespace mal {
     malValuePtr atom(malValuePtr value) {
@@ -35,6 +77,9 @@ namespace mal {
     }
 
     malValuePtr integer(int64_t value) {
+        if (malValuePtr::canHoldImmediate(value)) {
+            return malValuePtr::immediate(value);
+        }
         return malValuePtr(new malInteger(value));
     };
 
@@ -46,9 +91,10 @@ namespace mal {
         return malValuePtr(new malKeyword(token));
     };
 
-    malValuePtr lambda(const StringVec& bindings,
-                       malValuePtr body, malEnvPtr env) {
-        return malValuePtr(new malLambda(bindings, body, env));
+    malValuePtr lambda(const malSymbolIdVec& bindings,
+                       malValuePtr body, malEnvPtr env,
+                       malFrameLayoutPtr layout, malCodePtr code) {
+        return malValuePtr(new malLambda(bindings, body, env, layout, code));
     }
 
     malValuePtr list(malValueVec* items) {
@@ -59,6 +105,11 @@ namespace mal {
         return malValuePtr(new malList(begin, end));
     };
 
+    malValuePtr list(malItemsPtr items) {
+        int count = items->m_end - items->m_start;
+        return malValuePtr(new malList(items, items->m_start, count));
+    };
+
     malValuePtr list(malValuePtr a) {
         malValueVec* items = new malValueVec(1);
         items->at(0) = a;
@@ -94,9 +145,17 @@ namespace mal {
     }
 
     malValuePtr symbol(const String& token) {
-        return malValuePtr(new malSymbol(token));
+        return symbolTable().intern(token);
     };
 
+    malSymbolId symbolId(const String& token) {
+        return STATIC_CAST(malSymbol, symbol(token))->id();
+    }
+
+    const String& symbolName(malSymbolId id) {
+        return symbolTable().name(id);
+    }
+
     malValuePtr trueValue() {
         static malValuePtr c(new malConstant("true"));
         return malValuePtr(c);
@@ -109,6 +168,11 @@ namespace mal {
     malValuePtr vector(malValueIter begin, malValueIter end) {
         return malValuePtr(new malVector(begin, end));
     };
+
+    malValuePtr vector(malItemsPtr items) {
+        int count = items->m_end - items->m_start;
+        return malValuePtr(new malVector(items, items->m_start, count));
+    };
 };
 
 malValuePtr malBuiltIn::apply(malValueIter argsBegin,
@@ -117,27 +181,20 @@ malValuePtr malBuiltIn::apply(malValueIter argsBegin,
     return m_handler(m_name, argsBegin, argsEnd);
 }
 
-static String makeHashKey(malValuePtr key)
+// Cached hash codes are 0 until they're computed.
+static size_t nonZeroHash(size_t hash)
 {
-    if (const malString* skey = DYNAMIC_CAST(malString, key)) {
-        return skey->print(true);
-    }
-    else if (const malKeyword* kkey = DYNAMIC_CAST(malKeyword, key)) {
-        return kkey->print(true);
-    }
-    MAL_FAIL("%s is not a string or keyword", key->print(true).c_str());
+    return hash ? hash : 1;
 }
 
-static malHash::Map addToMap(malHash::Map& map,
+static void addToMap(malHash::Map& map,
     malValueIter argsBegin, malValueIter argsEnd)
 {
     // This is intended to be called with pre-evaluated arguments.
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it++);
-        map[key] = *it;
+        const malValuePtr& key = *it++;
+        map.set(key, *it);
     }
-
-    return map;
 }
 
 static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
@@ -146,46 +203,71 @@ static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
             "hash-map requires an even-sized list");
 
     malHash::Map map;
-    return addToMap(map, argsBegin, argsEnd);
+    addToMap(map, argsBegin, argsEnd);
+    return map;
 }
 
 malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
-: m_map(createMap(argsBegin, argsEnd))
+: malValue(MAL_HASH)
+, m_map(createMap(argsBegin, argsEnd))
 , m_isEvaluated(isEvaluated)
+, m_hashCode(0)
 {
 
 }
 
 malHash::malHash(const malHash::Map& map)
-: m_map(map)
+: malValue(MAL_HASH)
+, m_map(map)
 , m_isEvaluated(true)
+, m_hashCode(0)
 {
 
 }
 
+// A map with a single reference, which is the caller's, can't be seen by
+// anything else, so it can be updated in place. Metadata and unevaluated
+// literals are left alone, as the result of assoc has neither.
+bool malHash::isUnique() const
+{
+    return !isShared() && !hasMeta() && m_isEvaluated;
+}
+
+// The new map shares all but the changed paths of the trie with this one.
 malValuePtr
 malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
     MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
             "assoc requires an even-sized list");
 
+    if (isUnique()) {
+        malHash* self = const_cast<malHash*>(this);
+        addToMap(self->m_map, argsBegin, argsEnd);
+        self->m_hashCode = 0;
+        return malValuePtr(self);
+    }
     malHash::Map map(m_map);
-    return mal::hash(addToMap(map, argsBegin, argsEnd));
+    addToMap(map, argsBegin, argsEnd);
+    return mal::hash(map);
 }
 
 bool malHash::contains(malValuePtr key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it != m_map.end();
+    return m_map.find(key) != NULL;
 }
 
 malValuePtr
 malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    malHash::Map map(m_map);
+    malHash* self = const_cast<malHash*>(this);
+    malHash::Map copy;
+    malHash::Map& map = isUnique() ? self->m_map : (copy = m_map);
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it);
-        map.erase(key);
+        map.erase(*it);
+    }
+    if (&map == &m_map) {
+        self->m_hashCode = 0;
+        return malValuePtr(self);
     }
     return mal::hash(map);
 }
@@ -198,15 +280,15 @@ malValuePtr malHash::eval(malEnvPtr env)
 
     malHash::Map map;
     for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        map[it->first] = EVAL(it->second, env);
+        map.set(it->key, EVAL(it->value, env));
     }
     return mal::hash(map);
 }
 
 malValuePtr malHash::get(malValuePtr key) const
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it == m_map.end() ? mal::nilValue() : it->second;
+    const malValuePtr* value = m_map.find(key);
+    return value ? *value : mal::nilValue();
 }
 
 malValuePtr malHash::keys() const
@@ -214,12 +296,7 @@ malValuePtr malHash::keys() const
     malValueVec* keys = new malValueVec();
     keys->reserve(m_map.size());
     for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        if (it->first[0] == '"') {
-            keys->push_back(mal::string(unescape(it->first)));
-        }
-        else {
-            keys->push_back(mal::keyword(it->first));
-        }
+        keys->push_back(it->key);
     }
     return mal::list(keys);
 }
@@ -229,72 +306,111 @@ malValuePtr malHash::values() const
     malValueVec* keys = new malValueVec();
     keys->reserve(m_map.size());
     for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        keys->push_back(it->second);
+        keys->push_back(it->value);
     }
     return mal::list(keys);
 }
 
-String malHash::print(bool readably) const
+void malHash::printTo(RegionString& out, bool readably) const
 {
-    String s = "{";
+    out += '{';
 
     auto it = m_map.begin(), end = m_map.end();
     if (it != end) {
-        s += it->first + " " + it->second->print(readably);
+        it->key->printTo(out, true);
+        out += ' ';
+        it->value->printTo(out, readably);
         ++it;
     }
     for ( ; it != end; ++it) {
-        s += " " + it->first + " " + it->second->print(readably);
+        out += ' ';
+        it->key->printTo(out, true);
+        out += ' ';
+        it->value->printTo(out, readably);
     }
 
-    return s + "}";
+    out += '}';
 }
 
+// Equal maps can hold their entries in different orders, if keys with
+// colliding hashes went in in different orders, so once the sizes and
+// hashes match each key is looked up.
 bool malHash::doIsEqualTo(const malValue* rhs) const
 {
-    const malHash::Map& r_map = static_cast<const malHash*>(rhs)->m_map;
-    if (m_map.size() != r_map.size()) {
+    const malHash* r_hash = static_cast<const malHash*>(rhs);
+    const malHash::Map& r_map = r_hash->m_map;
+    if ((m_map.size() != r_map.size()) ||
+        (hashCode() != r_hash->hashCode())) {
         return false;
     }
 
-    for (auto it0 = m_map.begin(), end0 = m_map.end(), it1 = r_map.begin();
-         it0 != end0; ++it0, ++it1) {
-
-        if (it0->first != it1->first) {
-            return false;
-        }
-        if (!it0->second->isEqualTo(it1->second.ptr())) {
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        const malValuePtr* value = r_map.find(it->key);
+        if (!value || !it->value->isEqualTo(*value)) {
             return false;
         }
     }
     return true;
 }
 
-malLambda::malLambda(const StringVec& bindings,
-                     malValuePtr body, malEnvPtr env)
-: m_bindings(bindings)
+size_t malHash::hashCode() const
+{
+    if (m_hashCode == 0) {
+        size_t hash = 0;
+        for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+            hash += (it->hash * 31) ^ ::hashCode(it->value);
+        }
+        m_hashCode = nonZeroHash(hash);
+    }
+    return m_hashCode;
+}
+
+void malHash::traceRefs(RefTracer& tracer) const
+{
+    malValue::traceRefs(tracer);
+    m_map.traceRefs(tracer);
+}
+
+// Lambdas which weren't analysed get a layout holding just their
+// parameters.
+static malFrameLayoutPtr parameterLayout(const malSymbolIdVec& bindings)
+{
+    return new malFrameLayout(malFrameLayout::parameters(bindings));
+}
+
+malLambda::malLambda(const malSymbolIdVec& bindings,
+                     malValuePtr body, malEnvPtr env,
+                     malFrameLayoutPtr layout, malCodePtr code)
+: malApplicable(MAL_LAMBDA)
+, m_bindings(bindings)
 , m_body(body)
 , m_env(env)
+, m_layout(layout ? layout : parameterLayout(bindings))
+, m_code(code)
 , m_isMacro(false)
 {
 
 }
 
 malLambda::malLambda(const malLambda& that, malValuePtr meta)
-: malApplicable(meta)
+: malApplicable(MAL_LAMBDA, meta)
 , m_bindings(that.m_bindings)
 , m_body(that.m_body)
 , m_env(that.m_env)
+, m_layout(that.m_layout)
+, m_code(that.m_code)
 , m_isMacro(that.m_isMacro)
 {
 
 }
 
 malLambda::malLambda(const malLambda& that, bool isMacro)
-: malApplicable(that.m_meta)
+: malApplicable(MAL_LAMBDA, that.hasMeta() ? that.meta() : malValuePtr())
 , m_bindings(that.m_bindings)
 , m_body(that.m_body)
 , m_env(that.m_env)
+, m_layout(that.m_layout)
+, m_code(that.m_code)
 , m_isMacro(isMacro)
 {
 
@@ -303,7 +419,8 @@ malLambda::malLambda(const malLambda& that, bool isMacro)
 malValuePtr malLambda::apply(malValueIter argsBegin,
                              malValueIter argsEnd) const
 {
-    return EVAL(m_body, makeEnv(argsBegin, argsEnd));
+    return m_code ? m_code->execute(makeEnv(argsBegin, argsEnd))
+                  : EVAL(m_body, makeEnv(argsBegin, argsEnd));
 }
 
 malValuePtr malLambda::doWithMeta(malValuePtr meta) const
@@ -311,22 +428,41 @@ malValuePtr malLambda::doWithMeta(malValuePtr meta) const
     return new malLambda(*this, meta);
 }
 
+void malLambda::traceRefs(RefTracer& tracer) const
+{
+    malValue::traceRefs(tracer);
+    tracer(m_body);
+    tracer(m_env);
+    tracer(m_code);
+}
+
 malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
+    return malEnvPtr(new malEnv(m_env, m_layout, m_bindings,
+                                argsBegin, argsEnd));
+}
+
+malValuePtr malInteger::eval(malEnvPtr env)
+{
+    // This may be a temporary standing in for an immediate, see
+    // RefCountedArrow, so it mustn't return a pointer to itself.
+    if (malValuePtr::canHoldImmediate(m_value)) {
+        return malValuePtr::immediate(m_value);
+    }
+    return malValuePtr(this);
 }
 
 malValuePtr malList::conj(malValueIter argsBegin,
                           malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
     int newItemCount = std::distance(argsBegin, argsEnd);
+    malItemsPtr items = itemsToPrepend(newItemCount);
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items->prepend(*it);
+    }
 
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::reverse_copy(argsBegin, argsEnd, items->begin());
-    std::copy(begin(), end(), items->begin() + newItemCount);
-
-    return mal::list(items);
+    return malValuePtr(new malList(items, items->m_start,
+                                   m_count + newItemCount));
 }
 
 malValuePtr malList::eval(malEnvPtr env)
@@ -337,15 +473,18 @@ malValuePtr malList::eval(malEnvPtr env)
         return malValuePtr(this);
     }
 
-    std::unique_ptr<malValueVec> items(evalItems(env));
-    auto it = items->begin();
+    malArgs items;
+    evalItems(env, 0, items.items());
+    auto it = items.begin();
     malValuePtr op = *it;
-    return APPLY(op, ++it, items->end());
+    return APPLY(op, ++it, items.end());
 }
 
-String malList::print(bool readably) const
+void malList::printTo(RegionString& out, bool readably) const
 {
-    return '(' + malSequence::print(readably) + ')';
+    out += '(';
+    malSequence::printTo(out, readably);
+    out += ')';
 }
 
 malValuePtr malValue::eval(malEnvPtr env)
@@ -354,25 +493,115 @@ malValuePtr malValue::eval(malEnvPtr env)
     return malValuePtr(this);
 }
 
+String malValue::print(bool readably) const
+{
+    Region::Scope scope;
+    RegionString out;
+    printTo(out, readably);
+    return String(out.data(), out.size());
+}
+
 bool malValue::isEqualTo(const malValue* rhs) const
 {
+    if (this == rhs) {
+        return true;
+    }
+
     // Special-case. Vectors and Lists can be compared.
-    bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
-        (dynamic_cast<const malSequence*>(this) &&
-         dynamic_cast<const malSequence*>(rhs));
+    bool matchingTypes = (m_type == rhs->m_type) ||
+        (malSequence::hasType(type()) && malSequence::hasType(rhs->type()));
 
     return matchingTypes && doIsEqualTo(rhs);
 }
 
+bool malValue::isEqualTo(const malValuePtr& rhs) const
+{
+    if (rhs.isImmediate()) {
+        return (m_type == MAL_INTEGER) &&
+            (static_cast<const malInteger*>(this)->value() ==
+             rhs.immediateValue());
+    }
+    return isEqualTo(rhs.ptr());
+}
+
+size_t malValue::hashCode() const
+{
+    return std::hash<const malValue*>()(this);
+}
+
+size_t hashInteger(int64_t value)
+{
+    return std::hash<int64_t>()(value);
+}
+
+size_t malInteger::hashCode() const
+{
+    return hashInteger(m_value);
+}
+
+size_t malStringBase::hashCode() const
+{
+    if (m_hashCode == 0) {
+        m_hashCode = nonZeroHash(std::hash<String>()(m_value));
+    }
+    return m_hashCode;
+}
+
 bool malValue::isTrue() const
 {
-    return (this != mal::falseValue().ptr())
-        && (this != mal::nilValue().ptr());
+    return (m_type != MAL_CONSTANT)
+        || ((this != mal::falseValue().ptr())
+            && (this != mal::nilValue().ptr()));
+}
+
+typedef std::unordered_map<uintptr_t, malValuePtr> malMetaTable;
+
+// Under GC=mark-sweep a value's key mustn't look like a pointer to it, or
+// the table would keep every value with metadata alive.
+static uintptr_t metaKey(const malValue* value)
+{
+#if MARK_SWEEP
+    return ~reinterpret_cast<uintptr_t>(value);
+#else
+    return reinterpret_cast<uintptr_t>(value);
+#endif
+}
+
+// The metadata of every value which has any. It's never destroyed, as
+// values with metadata can outlive any static object.
+static malMetaTable& metaTable()
+{
+    static malMetaTable* table = new malMetaTable;
+    return *table;
 }
 
 malValuePtr malValue::meta() const
 {
-    return m_meta.ptr() == NULL ? mal::nilValue() : m_meta;
+    return m_hasMeta ? metaTable().find(metaKey(this))->second : mal::nilValue();
+}
+
+void malValue::setMeta(malValuePtr meta)
+{
+    if (meta) {
+        metaTable()[metaKey(this)] = std::move(meta);
+        m_hasMeta = true;
+    }
+}
+
+// The metadata is released once its entry has gone, as releasing it can
+// destroy other values with metadata.
+void malValue::dropMeta()
+{
+    auto it = metaTable().find(metaKey(this));
+    malValuePtr meta = std::move(it->second);
+    metaTable().erase(it);
+}
+
+void malValue::traceRefs(RefTracer& tracer) const
+{
+    if (m_hasMeta) {
+        tracer(metaTable().find(metaKey(this))->second);
+    }
 }
 
 malValuePtr malValue::withMeta(malValuePtr meta) const
@@ -380,119 +609,317 @@ malValuePtr malValue::withMeta(malValuePtr meta) const
     return doWithMeta(meta);
 }
 
-malSequence::malSequence(malValueVec* items)
-: m_items(items)
+malItems::malItems(int capacity, int start, int end)
+: m_capacity(capacity)
+, m_start(start)
+, m_end(end)
 {
+    for (int i = 0; i < capacity; i++) {
+        new (&slots()[i]) malValuePtr();
+    }
+}
 
+malItems* malItems::create(malValueVec* items)
+{
+    std::unique_ptr<malValueVec> owned(items);
+    return take(items->data(), items->data() + items->size());
 }
 
-malSequence::malSequence(malValueIter begin, malValueIter end)
-: m_items(new malValueVec(begin, end))
+malItems* malItems::take(malValueIter begin, malValueIter end)
 {
+    int count = std::distance(begin, end);
+    void* block = RefCounted::allocate(sizeFor(count));
+    malItems* created = new (block) malItems(count, 0, count);
+    std::move(begin, end, created->slots());
+    created->noteRefs(created->slots(), created->slots() + count);
+    return created;
+}
 
+malItems* malItems::create(malValueIter begin, malValueIter end,
+                           int capacity, int start)
+{
+    void* block = RefCounted::allocate(sizeFor(capacity));
+    malItems* created = new (block) malItems(capacity, start,
+                                             start + std::distance(begin, end));
+    std::copy(begin, end, created->slots() + start);
+    created->noteRefs(begin, end);
+    return created;
 }
 
-malSequence::malSequence(const malSequence& that, malValuePtr meta)
-: malValue(meta)
-, m_items(new malValueVec(*(that.m_items)))
+// The block is freed with the size it was allocated with, rather than that
+// of the class.
+void malItems::destroy() const
+{
+    size_t size = sizeFor(m_capacity);
+    this->~malItems();
+    RefCounted::deallocate(const_cast<malItems*>(this), size);
+}
+
+malSequence::malSequence(malType type, malValueVec* items)
+: malValue(type)
+, m_items(malItems::create(items))
+, m_offset(0)
+, m_count(m_items->m_end)
+, m_hashCode(0)
 {
 
 }
 
-malSequence::~malSequence()
+malSequence::malSequence(malType type, malValueIter begin, malValueIter end)
+: malValue(type)
+, m_items(malItems::create(begin, end, std::distance(begin, end)))
+, m_offset(0)
+, m_count(m_items->m_end)
+, m_hashCode(0)
 {
-    delete m_items;
+
 }
 
+malSequence::malSequence(malType type, malItemsPtr items, int offset,
+                         int count)
+: malValue(type)
+, m_items(items)
+, m_offset(offset)
+, m_count(count)
+, m_hashCode(0)
+{
+
+}
+
+// Sequences are immutable, so the copy shares the items.
+malSequence::malSequence(const malSequence& that, malValuePtr meta)
+: malValue(that.type(), meta)
+, m_items(that.m_items)
+, m_offset(that.m_offset)
+, m_count(that.m_count)
+, m_hashCode(that.m_hashCode)
+{
+
+}
+
+// Sequences whose hashes differ can't be equal. The hashes are kept, so
+// comparing a sequence again only walks the items when they match.
 bool malSequence::doIsEqualTo(const malValue* rhs) const
 {
     const malSequence* rhsSeq = static_cast<const malSequence*>(rhs);
-    if (count() != rhsSeq->count()) {
+    if ((count() != rhsSeq->count()) ||
+        (hashCode() != rhsSeq->hashCode())) {
         return false;
     }
 
-    for (malValueIter it0 = m_items->begin(),
+    for (malValueIter it0 = begin(),
                       it1 = rhsSeq->begin(),
-                      end = m_items->end(); it0 != end; ++it0, ++it1) {
+                      end = this->end(); it0 != end; ++it0, ++it1) {
 
-        if (! (*it0)->isEqualTo((*it1).ptr())) {
+        if ((*it0 != *it1) && !(*it0)->isEqualTo(*it1)) {
             return false;
         }
     }
     return true;
 }
 
-malValueVec* malSequence::evalItems(malEnvPtr env) const
+size_t malSequence::hashCode() const
+{
+    if (m_hashCode == 0) {
+        size_t hash = 1;
+        for (auto it = begin(), end = this->end(); it != end; ++it) {
+            hash = (hash * 31) + ::hashCode(*it);
+        }
+        m_hashCode = nonZeroHash(hash);
+    }
+    return m_hashCode;
+}
+
+void malSequence::traceRefs(RefTracer& tracer) const
+{
+    malValue::traceRefs(tracer);
+    tracer(m_items);
+}
+
+// Appends the values of the items from start onwards.
+void malSequence::evalItems(malEnvPtr env, int start,
+                            malValueVec& items) const
+{
+    items.reserve(items.size() + count() - start);
+    for (auto it = begin() + start, end = this->end(); it != end; ++it) {
+        items.push_back(EVAL(*it, env));
+    }
+}
+
+// Only a few vectors, of modest size, are kept. The rest are freed, so that
+// a deep recursion or a huge apply doesn't hold on to memory.
+static const size_t argsPoolSize = 64;
+static const size_t argsCapacityLimit = 256;
+
+// The pool frees its vectors at exit, so they aren't reported as leaks.
+struct malArgsPool : std::vector<malValueVec*> {
+    ~malArgsPool() {
+        for (auto it = begin(), e = end(); it != e; ++it) {
+            delete *it;
+        }
+    }
+};
+
+static malArgsPool& argsPool()
+{
+    static malArgsPool pool;
+    return pool;
+}
+
+static malValueVec* takeArgs()
 {
-    malValueVec* items = new malValueVec;;
-    items->reserve(count());
-    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
-        items->push_back(EVAL(*it, env));
+    malArgsPool& pool = argsPool();
+    if (pool.empty()) {
+        return new malValueVec;
     }
+    malValueVec* items = pool.back();
+    pool.pop_back();
     return items;
 }
 
+malArgs::malArgs()
+: m_items(takeArgs())
+{
+
+}
+
+malArgs::~malArgs()
+{
+    malArgsPool& pool = argsPool();
+    if ((pool.size() < argsPoolSize) &&
+        (m_items->capacity() <= argsCapacityLimit)) {
+        m_items->clear();
+        pool.push_back(m_items);
+    }
+    else {
+        delete m_items;
+    }
+}
+
 malValuePtr malSequence::first() const
 {
     return count() == 0 ? mal::nilValue() : item(0);
 }
 
-String malSequence::print(bool readably) const
+void malSequence::printTo(RegionString& out, bool readably) const
 {
-    String str;
-    auto end = m_items->cend();
-    auto it = m_items->cbegin();
+    auto end = this->end();
+    auto it = begin();
     if (it != end) {
-        str += (*it)->print(readably);
+        (*it)->printTo(out, readably);
         ++it;
     }
     for ( ; it != end; ++it) {
-        str += " ";
-        str += (*it)->print(readably);
+        out += ' ';
+        (*it)->printTo(out, readably);
     }
-    return str;
 }
 
-malValuePtr malSequence::rest() const
+malValuePtr malSequence::cons(malValuePtr first) const
 {
-    malValueIter start = (count() > 0) ? begin() + 1 : end();
-    return mal::list(start, end());
+    malItemsPtr items = itemsToPrepend(1);
+    items->prepend(first);
+    return malValuePtr(new malList(items, items->m_start, m_count + 1));
 }
 
-String malString::escapedValue() const
+// The free slots after ours, or a copy of our items with room to grow at
+// the back, so that appending repeatedly takes amortised constant time.
+malItemsPtr malSequence::itemsToAppend(int count) const
 {
-    return escape(value());
+    if (m_items->canAppend(m_offset + m_count, count)) {
+        return m_items;
+    }
+    int capacity = std::max(2 * (m_count + count), 8);
+    return malItems::create(begin(), end(), capacity);
 }
 
-String malString::print(bool readably) const
+malValuePtr malSequence::concat(malValueIter argsBegin,
+                                malValueIter argsEnd) const
 {
-    return readably ? escapedValue() : value();
+    int newItemCount = 0;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        newItemCount += VALUE_CAST(malSequence, *it)->count();
+    }
+    if (newItemCount == 0) {
+        return asList();
+    }
+
+    malItemsPtr items = itemsToAppend(newItemCount);
+    int offset = items->m_end - m_count;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        const malSequence* seq = STATIC_CAST(malSequence, *it);
+        items->append(seq->begin(), seq->end());
+    }
+
+    return malValuePtr(new malList(items, offset, m_count + newItemCount));
+}
+
+// The free slots before ours, or a copy of our items with room to grow at
+// the front.
+malItemsPtr malSequence::itemsToPrepend(int count) const
+{
+    if (m_items->canPrepend(m_offset, count)) {
+        return m_items;
+    }
+    int capacity = std::max(2 * (m_count + count), 8);
+    return malItems::create(begin(), end(), capacity, capacity - m_count);
+}
+
+malValuePtr malSequence::asList() const
+{
+    return malValuePtr(new malList(m_items, m_offset, m_count));
+}
+
+malValuePtr malSequence::asVector() const
+{
+    return malValuePtr(new malVector(m_items, m_offset, m_count));
+}
+
+// The rest shares this sequence's items.
+malValuePtr malSequence::rest() const
+{
+    if (m_count == 0) {
+        return mal::list(new malValueVec);
+    }
+    return malValuePtr(new malList(m_items, m_offset + 1, m_count - 1));
+}
+
+void malString::printTo(RegionString& out, bool readably) const
+{
+    if (readably) {
+        escape(out, value());
+    }
+    else {
+        out += value();
+    }
 }
 
 malValuePtr malSymbol::eval(malEnvPtr env)
 {
-    return env->get(value());
+    return env->get(m_id);
 }
 
 malValuePtr malVector::conj(malValueIter argsBegin,
                             malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
     int newItemCount = std::distance(argsBegin, argsEnd);
+    malItemsPtr items = itemsToAppend(newItemCount);
+    int offset = items->m_end - m_count;
+    items->append(argsBegin, argsEnd);
 
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::copy(begin(), end(), items->begin());
-    std::copy(argsBegin, argsEnd, items->begin() + oldItemCount);
-
-    return mal::vector(items);
+    return malValuePtr(new malVector(items, offset, m_count + newItemCount));
 }
 
 malValuePtr malVector::eval(malEnvPtr env)
 {
-    return mal::vector(evalItems(env));
+    std::unique_ptr<malValueVec> items(new malValueVec);
+    evalItems(env, 0, *items);
+    return mal::vector(items.release());
 }
 
-String malVector::print(bool readably) const
+void malVector::printTo(RegionString& out, bool readably) const
 {
-    return '[' + malSequence::print(readably) + ']';
+    out += '[';
+    malSequence::printTo(out, readably);
+    out += ']';
 }
@@ -2,52 +2,99 @@
 #define INCLUDE_TYPES_H
 
 #include "MAL.h"
+#include "Environment.h"
+#include "HashTrie.h"
 
+#include <algorithm>
 #include <exception>
 #include <map>
+#include <type_traits>
 
 class malEmptyInputException : public std::exception { };
 
+// The concrete type of a value, so that checking it doesn't need RTTI. The
+// types derived from the same class are kept together, so a class's check
+// is a range check.
+enum malType {
+    MAL_CONSTANT,
+    MAL_INTEGER,
+    MAL_STRING,     // malStringBase
+    MAL_KEYWORD,    //
+    MAL_SYMBOL,     //
+    MAL_LIST,       // malSequence
+    MAL_VECTOR,     //
+    MAL_HASH,
+    MAL_BUILTIN,    // malApplicable
+    MAL_LAMBDA,     //
+    MAL_ATOM,
+};
+
+// Values which hold other values, which the cycle collector traces. So are
+// values with metadata, which could hold an atom.
+inline bool isContainer(malType type)
+{
+    return ((type >= MAL_LIST) && (type <= MAL_HASH)) || (type >= MAL_LAMBDA);
+}
+
 class malValue : public RefCounted {
 public:
-    malValue() {
+    malValue(malType type)
+    : RefCounted(isContainer(type)), m_type(type), m_hasMeta(false) {
         TRACE_OBJECT("Creating malValue %p\n", this);
     }
-    malValue(malValuePtr meta) : m_meta(meta) {
+    malValue(malType type, malValuePtr meta)
+    : RefCounted(isContainer(type) || meta), m_type(type), m_hasMeta(false) {
         TRACE_OBJECT("Creating malValue %p\n", this);
+        setMeta(meta);
     }
     virtual ~malValue() {
         TRACE_OBJECT("Destroying malValue %p\n", this);
+        if (m_hasMeta) {
+            dropMeta();
+        }
     }
 
     malValuePtr withMeta(malValuePtr meta) const;
     virtual malValuePtr doWithMeta(malValuePtr meta) const = 0;
     malValuePtr meta() const;
 
+    malType type() const { return malType(m_type); }
+    static bool hasType(malType type) { return true; }
+
     bool isTrue() const;
 
     bool isEqualTo(const malValue* rhs) const;
+    bool isEqualTo(const malValuePtr& rhs) const;
+
+    // Equal values have equal hash codes. Values which are only equal to
+    // themselves hash their address.
+    virtual size_t hashCode() const;
 
     virtual malValuePtr eval(malEnvPtr env);
 
-    virtual String print(bool readably) const = 0;
+    // Prints into scratch space in the Region, and copies out the text.
+    String print(bool readably) const;
+    virtual void printTo(RegionString& out, bool readably) const = 0;
+
+    virtual void traceRefs(RefTracer& tracer) const;
 
 protected:
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
 
-    malValuePtr m_meta;
-};
+    bool hasMeta() const { return m_hasMeta; }
 
-template<class T>
-T* value_cast(malValuePtr obj, const char* typeName) {
-    T* dest = dynamic_cast<T*>(obj.ptr());
-    MAL_CHECK(dest != NULL, "%s is not a %s",
-              obj->print(true).c_str(), typeName);
-    return dest;
-}
+private:
+    void setMeta(malValuePtr meta);
+    void dropMeta();
+
+    // These fit in the padding after the reference count. Few values have
+    // metadata, so it's kept in a table rather than in every value.
+    const uint8_t m_type;
+    bool m_hasMeta;
+};
 
 #define VALUE_CAST(Type, Value)    value_cast<Type>(Value, #Type)
-#define DYNAMIC_CAST(Type, Value)  (dynamic_cast<Type*>((Value).ptr()))
+#define DYNAMIC_CAST(Type, Value)  dynamic_value_cast<Type>(Value)
 #define STATIC_CAST(Type, Value)   (static_cast<Type*>((Value).ptr()))
 
 #define WITH_META(Type) \
@@ -57,11 +104,15 @@ T* value_cast(malValuePtr obj, const char* typeName) {
 
 class malConstant : public malValue {
 public:
-    malConstant(String name) : m_name(name) { }
+    malConstant(String name) : malValue(MAL_CONSTANT), m_name(name) { }
     malConstant(const malConstant& that, malValuePtr meta)
-        : malValue(meta), m_name(that.m_name) { }
+        : malValue(MAL_CONSTANT, meta), m_name(that.m_name) { }
 
-    virtual String print(bool readably) const { return m_name; }
+    static bool hasType(malType type) { return type == MAL_CONSTANT; }
+
+    virtual void printTo(RegionString& out, bool readably) const {
+        out += m_name;
+    }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this == rhs; // these are singletons
@@ -75,16 +126,22 @@ private:
 
 class malInteger : public malValue {
 public:
-    malInteger(int64_t value) : m_value(value) { }
+    malInteger(int64_t value) : malValue(MAL_INTEGER), m_value(value) { }
     malInteger(const malInteger& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(MAL_INTEGER, meta), m_value(that.m_value) { }
 
-    virtual String print(bool readably) const {
-        return std::to_string(m_value);
+    static bool hasType(malType type) { return type == MAL_INTEGER; }
+
+    virtual void printTo(RegionString& out, bool readably) const {
+        out += std::to_string(m_value);
     }
 
     int64_t value() const { return m_value; }
 
+    virtual malValuePtr eval(malEnvPtr env);
+
+    virtual size_t hashCode() const;
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return m_value == static_cast<const malInteger*>(rhs)->m_value;
     }
@@ -95,31 +152,97 @@ private:
     const int64_t m_value;
 };
 
+inline malValue* RefCountedImmediate<malValue>::box(intptr_t value)
+{
+    return new malInteger(value);
+}
+
+// The type of a value, without boxing it if it's an immediate.
+inline malType typeOf(const malValuePtr& obj)
+{
+    return obj.isImmediate() ? MAL_INTEGER : obj->type();
+}
+
+// Immediate integers are only boxed when they're cast to a type which can
+// hold an integer. The box replaces the immediate in obj, so obj must outlive
+// the returned pointer.
+template<class T>
+T* dynamic_value_cast(const malValuePtr& obj) {
+    if (obj.isImmediate() && !std::is_base_of<T, malInteger>::value) {
+        return NULL;
+    }
+    malValue* value = obj.ptr();
+    return T::hasType(value->type()) ? static_cast<T*>(value) : NULL;
+}
+
+template<class T>
+T* value_cast(const malValuePtr& obj, const char* typeName) {
+    T* dest = dynamic_value_cast<T>(obj);
+    MAL_CHECK(dest != NULL, "%s is not a %s",
+              obj->print(true).c_str(), typeName);
+    return dest;
+}
+
+inline bool isInteger(const malValuePtr& obj)
+{
+    return obj.isImmediate() || DYNAMIC_CAST(malInteger, obj);
+}
+
+// Reads an integer without boxing it if it's an immediate.
+inline int64_t integerValue(const malValuePtr& obj)
+{
+    if (obj.isImmediate()) {
+        return obj.immediateValue();
+    }
+    return VALUE_CAST(malInteger, obj)->value();
+}
+
+size_t hashInteger(int64_t value);
+
+// The hash code of a value, without boxing it if it's an immediate.
+inline size_t hashCode(const malValuePtr& obj)
+{
+    if (obj.isImmediate()) {
+        return hashInteger(obj.immediateValue());
+    }
+    return obj->hashCode();
+}
+
 class malStringBase : public malValue {
 public:
-    malStringBase(const String& token)
-        : m_value(token) { }
+    malStringBase(malType type, const String& token)
+        : malValue(type), m_value(token), m_hashCode(0) { }
     malStringBase(const malStringBase& that, malValuePtr meta)
-        : malValue(meta), m_value(that.value()) { }
+        : malValue(that.type(), meta), m_value(that.value())
+        , m_hashCode(that.m_hashCode) { }
+
+    static bool hasType(malType type) {
+        return (type >= MAL_STRING) && (type <= MAL_SYMBOL);
+    }
+
+    virtual void printTo(RegionString& out, bool readably) const {
+        out += m_value;
+    }
 
-    virtual String print(bool readably) const { return m_value; }
+    const String& value() const { return m_value; }
 
-    String value() const { return m_value; }
+    virtual size_t hashCode() const;
 
 private:
     const String m_value;
+    mutable size_t m_hashCode; // 0 until it's first needed
 };
 
 class malString : public malStringBase {
 public:
     malString(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(MAL_STRING, token) { }
     malString(const malString& that, malValuePtr meta)
         : malStringBase(that, meta) { }
 
-    virtual String print(bool readably) const;
+    static bool hasType(malType type) { return type == MAL_STRING; }
 
-    String escapedValue() const;
+    virtual void printTo(RegionString& out, bool readably) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return value() == static_cast<const malString*>(rhs)->value();
@@ -131,10 +254,12 @@ public:
 class malKeyword : public malStringBase {
 public:
     malKeyword(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(MAL_KEYWORD, token) { }
     malKeyword(const malKeyword& that, malValuePtr meta)
         : malStringBase(that, meta) { }
 
+    static bool hasType(malType type) { return type == MAL_KEYWORD; }
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return value() == static_cast<const malKeyword*>(rhs)->value();
     }
@@ -144,58 +269,212 @@ public:
 
 class malSymbol : public malStringBase {
 public:
-    malSymbol(const String& token)
-        : malStringBase(token) { }
+    malSymbol(const String& token, malSymbolId id)
+        : malStringBase(MAL_SYMBOL, token), m_id(id) { }
     malSymbol(const malSymbol& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malStringBase(that, meta), m_id(that.m_id) { }
+
+    static bool hasType(malType type) { return type == MAL_SYMBOL; }
 
     virtual malValuePtr eval(malEnvPtr env);
 
+    malSymbolId id() const { return m_id; }
+
+    malSpecialForm specialForm() const {
+        return (m_id < SPECIAL_NONE) ? malSpecialForm(m_id) : SPECIAL_NONE;
+    }
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
-        return value() == static_cast<const malSymbol*>(rhs)->value();
+        return m_id == static_cast<const malSymbol*>(rhs)->m_id;
     }
 
     WITH_META(malSymbol);
+
+private:
+    const malSymbolId m_id;
 };
 
+// The slots holding the items of one or more sequences, each of which sees
+// a range of them. Only the slots from m_start up to m_end are in use. A
+// sequence whose range ends at m_end can claim the free slots after it, and
+// one whose range begins at m_start the free slots before it, so conj onto
+// the latest version of a vector, or cons onto that of a list, doesn't copy
+// it. The slots follow the counts in the same block, and are never
+// reallocated, so iterators into them stay valid.
+//
+// Items are only traced by the cycle collector once they hold a value which
+// is, so that long lists of numbers and strings don't have to be.
+class malItems : public RefCounted {
+public:
+    // The items are moved out of the vector, which is deleted.
+    static malItems* create(malValueVec* items);
+    // The items are moved out of the range, which is left holding nulls.
+    static malItems* take(malValueIter begin, malValueIter end);
+    // The items go in at start, leaving the rest of the slots free.
+    static malItems* create(malValueIter begin, malValueIter end,
+                            int capacity, int start = 0);
+
+    virtual ~malItems() {
+        for (int i = 0; i < m_capacity; i++) {
+            slots()[i].~malValuePtr();
+        }
+    }
+    virtual void destroy() const;
+
+    malValueIter slots() const {
+        return reinterpret_cast<malValuePtr*>(const_cast<malItems*>(this) + 1);
+    }
+
+    // When only one sequence uses these items, the slots outside its range
+    // are free too, and are released first.
+    bool canAppend(int end, int count) {
+        if (!isShared() && (end < m_end)) {
+            clearSlots(end, m_end);
+            m_end = end;
+        }
+        return (end == m_end) && (m_end + count <= m_capacity);
+    }
+    void append(malValueIter begin, malValueIter end) {
+        m_end = std::copy(begin, end, slots() + m_end) - slots();
+        noteRefs(begin, end);
+    }
+
+    bool canPrepend(int begin, int count) {
+        if (!isShared() && (begin > m_start)) {
+            clearSlots(m_start, begin);
+            m_start = begin;
+        }
+        return (begin == m_start) && (count <= m_start);
+    }
+    void prepend(malValuePtr item) {
+        noteRef(item);
+        slots()[--m_start] = std::move(item);
+    }
+
+    // The free slots too, as they may not have been cleared yet.
+    virtual void traceRefs(RefTracer& tracer) const {
+        for (int i = 0; i < m_capacity; i++) {
+            tracer(slots()[i]);
+        }
+    }
+
+    const int m_capacity;
+    int m_start;
+    int m_end;
+
+private:
+    malItems(int capacity, int start, int end);
+
+    static size_t sizeFor(int capacity) {
+        return sizeof(malItems) + capacity * sizeof(malValuePtr);
+    }
+
+    void noteRefs(malValueIter begin, malValueIter end) {
+        for (auto it = begin; (it != end) && !isTraced(); ++it) {
+            noteRef(*it);
+        }
+    }
+
+    void clearSlots(int begin, int end) {
+        std::fill(slots() + begin, slots() + end, malValuePtr());
+    }
+};
+
+typedef RefCountedPtr<malItems> malItemsPtr;
+
 class malSequence : public malValue {
 public:
-    malSequence(malValueVec* items);
-    malSequence(malValueIter begin, malValueIter end);
+    malSequence(malType type, malValueVec* items);
+    malSequence(malType type, malValueIter begin, malValueIter end);
+    malSequence(malType type, malItemsPtr items, int offset, int count);
     malSequence(const malSequence& that, malValuePtr meta);
-    virtual ~malSequence();
 
-    virtual String print(bool readably) const;
+    static bool hasType(malType type) {
+        return (type == MAL_LIST) || (type == MAL_VECTOR);
+    }
+
+    virtual void printTo(RegionString& out, bool readably) const;
 
-    malValueVec* evalItems(malEnvPtr env) const;
-    int count() const { return m_items->size(); }
-    bool isEmpty() const { return m_items->empty(); }
-    malValuePtr item(int index) const { return (*m_items)[index]; }
+    void evalItems(malEnvPtr env, int start, malValueVec& items) const;
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+    const malValuePtr& item(int index) const {
+        return m_items->slots()[m_offset + index];
+    }
 
-    malValueIter begin() const { return m_items->begin(); }
-    malValueIter end()   const { return m_items->end(); }
+    malValueIter begin() const { return m_items->slots() + m_offset; }
+    malValueIter end()   const { return begin() + m_count; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
+    // Lists and vectors with equal items hash alike, as they're equal.
+    virtual size_t hashCode() const;
+
     virtual malValuePtr conj(malValueIter argsBegin,
                               malValueIter argsEnd) const = 0;
 
     malValuePtr first() const;
     virtual malValuePtr rest() const;
+    malValuePtr cons(malValuePtr first) const;
+
+    // Returns a list of these items followed by those of the sequences.
+    malValuePtr concat(malValueIter argsBegin, malValueIter argsEnd) const;
+
+    // These share this sequence's items.
+    malValuePtr asList() const;
+    malValuePtr asVector() const;
+
+    virtual void traceRefs(RefTracer& tracer) const;
+
+    // The items are all that can change. A cycle through the sequence which
+    // forms after they're traced also goes through them, and is found once
+    // they're released.
+    virtual bool canBeInCycle() const {
+        return hasMeta() || m_items->isTraced();
+    }
+
+protected:
+    malItemsPtr itemsToAppend(int count) const;
+    malItemsPtr itemsToPrepend(int count) const;
+
+    const malItemsPtr m_items;
+    const int m_offset;
+    const int m_count;
+    mutable size_t m_hashCode; // 0 until it's first needed
+};
+
+// A vector for the arguments of a call. Vectors come from a pool and keep
+// their capacity when they go back, so once the pool has warmed up making
+// a call doesn't allocate one.
+class malArgs {
+public:
+    malArgs();
+    ~malArgs();
+
+    malValueVec& items() const { return *m_items; }
+    malValueIter begin() const { return m_items->data(); }
+    malValueIter end() const { return begin() + m_items->size(); }
 
 private:
+    malArgs(const malArgs&); // no copy ctor
+    malArgs& operator = (const malArgs&); // no assignments
+
     malValueVec* const m_items;
 };
 
 class malList : public malSequence {
 public:
-    malList(malValueVec* items) : malSequence(items) { }
+    malList(malValueVec* items) : malSequence(MAL_LIST, items) { }
     malList(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+        : malSequence(MAL_LIST, begin, end) { }
+    malList(malItemsPtr items, int offset, int count)
+        : malSequence(MAL_LIST, items, offset, count) { }
     malList(const malList& that, malValuePtr meta)
         : malSequence(that, meta) { }
 
-    virtual String print(bool readably) const;
+    static bool hasType(malType type) { return type == MAL_LIST; }
+
+    virtual void printTo(RegionString& out, bool readably) const;
     virtual malValuePtr eval(malEnvPtr env);
 
     virtual malValuePtr conj(malValueIter argsBegin,
@@ -206,14 +485,18 @@ public:
 
 class malVector : public malSequence {
 public:
-    malVector(malValueVec* items) : malSequence(items) { }
+    malVector(malValueVec* items) : malSequence(MAL_VECTOR, items) { }
     malVector(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+        : malSequence(MAL_VECTOR, begin, end) { }
+    malVector(malItemsPtr items, int offset, int count)
+        : malSequence(MAL_VECTOR, items, offset, count) { }
     malVector(const malVector& that, malValuePtr meta)
         : malSequence(that, meta) { }
 
+    static bool hasType(malType type) { return type == MAL_VECTOR; }
+
     virtual malValuePtr eval(malEnvPtr env);
-    virtual String print(bool readably) const;
+    virtual void printTo(RegionString& out, bool readably) const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
@@ -223,8 +506,12 @@ public:
 
 class malApplicable : public malValue {
 public:
-    malApplicable() { }
-    malApplicable(malValuePtr meta) : malValue(meta) { }
+    malApplicable(malType type) : malValue(type) { }
+    malApplicable(malType type, malValuePtr meta) : malValue(type, meta) { }
+
+    static bool hasType(malType type) {
+        return (type == MAL_BUILTIN) || (type == MAL_LAMBDA);
+    }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                                malValueIter argsEnd) const = 0;
@@ -232,30 +519,42 @@ public:
 
 class malHash : public malValue {
 public:
-    typedef std::map<String, malValuePtr> Map;
+    typedef HashTrie Map;
 
     malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
     malHash(const malHash::Map& map);
     malHash(const malHash& that, malValuePtr meta)
-    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+    : malValue(MAL_HASH, meta), m_map(that.m_map)
+    , m_isEvaluated(that.m_isEvaluated), m_hashCode(that.m_hashCode) { }
+
+    static bool hasType(malType type) { return type == MAL_HASH; }
 
     malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
     malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
     bool contains(malValuePtr key) const;
     malValuePtr eval(malEnvPtr env);
     malValuePtr get(malValuePtr key) const;
+    bool isEvaluated() const { return m_isEvaluated; }
     malValuePtr keys() const;
     malValuePtr values() const;
 
-    virtual String print(bool readably) const;
+    virtual void printTo(RegionString& out, bool readably) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
 
+    // The same for any order of the entries.
+    virtual size_t hashCode() const;
+
+    virtual void traceRefs(RefTracer& tracer) const;
+
     WITH_META(malHash);
 
 private:
-    const Map m_map;
+    bool isUnique() const;
+
+    Map m_map;
     const bool m_isEvaluated;
+    mutable size_t m_hashCode; // 0 until it's first needed
 };
 
 class malBuiltIn : public malApplicable {
@@ -265,16 +564,19 @@ public:
                                     malValueIter argsEnd);
 
     malBuiltIn(const String& name, ApplyFunc* handler)
-    : m_name(name), m_handler(handler) { }
+    : malApplicable(MAL_BUILTIN), m_name(name), m_handler(handler) { }
 
     malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    : malApplicable(MAL_BUILTIN, meta), m_name(that.m_name)
+    , m_handler(that.m_handler) { }
+
+    static bool hasType(malType type) { return type == MAL_BUILTIN; }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
-    virtual String print(bool readably) const {
-        return STRF("#builtin-function(%s)", m_name.c_str());
+    virtual void printTo(RegionString& out, bool readably) const {
+        out += STRF("#builtin-function(%s)", m_name.c_str());
     }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
@@ -290,55 +592,91 @@ private:
     ApplyFunc* m_handler;
 };
 
+// The executable form of a fn* body, built by Analyzer.cpp, or by the
+// compiler in VM.cpp, which tells its own code apart by the kind.
+class malCode : public RefCounted {
+public:
+    enum Kind { NODES, BYTECODE };
+
+    malCode(Kind kind) : RefCounted(true), m_kind(kind) { }
+
+    Kind kind() const { return m_kind; }
+
+    virtual malValuePtr execute(malEnvPtr env) const = 0;
+
+private:
+    const Kind m_kind;
+};
+
+typedef RefCountedPtr<malCode> malCodePtr;
+
 class malLambda : public malApplicable {
 public:
-    malLambda(const StringVec& bindings, malValuePtr body, malEnvPtr env);
+    malLambda(const malSymbolIdVec& bindings, malValuePtr body, malEnvPtr env,
+              malFrameLayoutPtr layout, malCodePtr code);
     malLambda(const malLambda& that, malValuePtr meta);
     malLambda(const malLambda& that, bool isMacro);
 
+    static bool hasType(malType type) { return type == MAL_LAMBDA; }
+
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
     malValuePtr getBody() const { return m_body; }
+    const malCode* getCode() const { return m_code.ptr(); }
     malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this == rhs; // do we need to do a deep inspection?
     }
 
-    virtual String print(bool readably) const {
-        return STRF("#user-%s(%p)", m_isMacro ? "macro" : "function", this);
+    virtual void printTo(RegionString& out, bool readably) const {
+        out += STRF("#user-%s(%p)", m_isMacro ? "macro" : "function", this);
     }
 
     bool isMacro() const { return m_isMacro; }
 
     virtual malValuePtr doWithMeta(malValuePtr meta) const;
 
+    virtual void traceRefs(RefTracer& tracer) const;
+
 private:
-    const StringVec   m_bindings;
-    const malValuePtr m_body;
-    const malEnvPtr   m_env;
-    const bool        m_isMacro;
+    const malSymbolIdVec m_bindings;
+    const malValuePtr    m_body;
+    const malEnvPtr      m_env;
+    const malFrameLayoutPtr m_layout;
+    const malCodePtr     m_code;
+    const bool           m_isMacro;
 };
 
 class malAtom : public malValue {
 public:
-    malAtom(malValuePtr value) : m_value(value) { }
+    malAtom(malValuePtr value) : malValue(MAL_ATOM), m_value(value) { }
     malAtom(const malAtom& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : malValue(MAL_ATOM, meta), m_value(that.m_value) { }
+
+    static bool hasType(malType type) { return type == MAL_ATOM; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this->m_value->isEqualTo(rhs);
     }
 
-    virtual String print(bool readably) const {
-        return "(atom " + m_value->print(readably) + ")";
+    virtual void printTo(RegionString& out, bool readably) const {
+        out += "(atom ";
+        m_value->printTo(out, readably);
+        out += ')';
     };
 
     malValuePtr deref() const { return m_value; }
 
     malValuePtr reset(malValuePtr value) { return m_value = value; }
 
+    virtual void traceRefs(RefTracer& tracer) const {
+        malValue::traceRefs(tracer);
+        tracer(m_value);
+    }
+    virtual void clearRefs() { m_value = NULL; }
+
     WITH_META(malAtom);
 
 private:
@@ -356,9 +694,12 @@ namespace mal {
     malValuePtr integer(int64_t value);
     malValuePtr integer(const String& token);
     malValuePtr keyword(const String& token);
-    malValuePtr lambda(const StringVec&, malValuePtr, malEnvPtr);
+    malValuePtr lambda(const malSymbolIdVec&, malValuePtr, malEnvPtr,
+                       malFrameLayoutPtr layout = NULL,
+                       malCodePtr code = NULL);
     malValuePtr list(malValueVec* items);
     malValuePtr list(malValueIter begin, malValueIter end);
+    malValuePtr list(malItemsPtr items);
     malValuePtr list(malValuePtr a);
     malValuePtr list(malValuePtr a, malValuePtr b);
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c);
@@ -366,9 +707,12 @@ namespace mal {
     malValuePtr nilValue();
     malValuePtr string(const String& token);
     malValuePtr symbol(const String& token);
+    malSymbolId symbolId(const String& token);
+    const String& symbolName(malSymbolId id);
     malValuePtr trueValue();
     malValuePtr vector(malValueVec* items);
     malValuePtr vector(malValueIter begin, malValueIter end);
+    malValuePtr vector(malItemsPtr items);
 };
 
 #endif // INCLUDE_TYPES_H
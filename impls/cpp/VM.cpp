@@ -0,0 +1,932 @@
+#include "MAL.h"
+#include "Environment.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <iostream>
+
+// The VM compiles each top level form into bytecode for a stack machine,
+// and runs it. The fn* forms inside it are compiled at the same time, each
+// into its own Proto, which becomes the malCode of every malLambda made
+// from it. Builtins which call lambdas, such as map and apply, go through
+// malLambda::apply, which starts a nested run of the machine.
+//
+// Local variables live in frame slots, as in Analyzer.cpp, so a closure
+// just captures its malEnv. The operand stack holds temporaries and the
+// arguments of the calls being made. Calls from one compiled lambda to
+// another push a frame rather than recursing, and tail calls replace it.
+//
+// Macros which are defined when a form is compiled are expanded then,
+// behind a guard which checks that the macro hasn't been redefined since.
+// If it has, or the head of a call turns out to be a macro when it runs,
+// the call is compiled again against the frames it's running in.
+//
+// Dispatch uses the labels as values extension of GCC and Clang.
+
+namespace {
+
+// Operands follow the opcode. Jump targets are offsets from the start of
+// the code.
+#define VM_OPCODES(X)                                                      \
+    X(CONSTANT)       /* constant                                      */ \
+    X(LOCAL)          /* slot, symbol                                  */ \
+    X(OUTER_LOCAL)    /* depth, slot, symbol                           */ \
+    X(GLOBAL)         /* depth, symbol, cache                          */ \
+    X(LOOKUP)         /* symbol                                        */ \
+    X(SET_LOCAL)      /* slot                                          */ \
+    X(DEFINE_LOCAL)   /* slot                                          */ \
+    X(DEFINE)         /* symbol                                        */ \
+    X(MACRO)          /*                                               */ \
+    X(POP)            /*                                               */ \
+    X(JUMP)           /* target                                        */ \
+    X(JUMP_IF_FALSE)  /* target                                        */ \
+    X(CLOSURE)        /* proto                                         */ \
+    X(VECTOR)         /* count                                         */ \
+    X(HASH)           /* count                                         */ \
+    X(CALLEE)         /* form constant, isTail, target, expansion      */ \
+    X(MACRO_GUARD)    /* as CALLEE, then the macro constant            */ \
+    X(CALL)           /* argument count                                */ \
+    X(TAIL_CALL)      /* argument count                                */ \
+    X(RETURN)         /*                                               */ \
+    X(ENTER)          /* layout                                        */ \
+    X(LEAVE)          /*                                               */ \
+    X(TRY)            /* catch target, end target                      */ \
+    X(END_TRY)        /*                                               */ \
+    X(EVAL)           /* form constant                                 */ \
+    X(FAIL)           /* message constant                              */ \
+    X(THROW)          /* value constant                                */ \
+    X(TRACE)          /* form constant                                 */
+
+enum OpCode {
+#define X(name) OP_##name,
+    VM_OPCODES(X)
+#undef X
+};
+
+struct Proto;
+typedef RefCountedPtr<Proto> ProtoPtr;
+
+// The code CALLEE or MACRO_GUARD compiled for a call when it ran, and the
+// head it was compiled for.
+struct Expansion {
+    malValuePtr macro;
+    ProtoPtr code;
+};
+
+// The compiled form of a fn* body, or of a top level form.
+struct Proto : public malCode {
+    Proto(const malSymbolIdVec& params, malValuePtr body)
+    : malCode(BYTECODE), params(params), body(body) { }
+
+    virtual malValuePtr execute(malEnvPtr env) const;
+
+    virtual void traceRefs(RefTracer& tracer) const;
+    virtual void clearRefs() { expansions.clear(); }
+
+    std::vector<int> code;
+    malValueVec constants;
+    std::vector<ProtoPtr> protos;             // for CLOSURE
+    std::vector<malFrameLayoutPtr> layouts;   // for ENTER
+
+    // Where GLOBAL found each value in the root, once it has.
+    mutable std::vector<const malValuePtr*> globals;
+    mutable std::vector<Expansion> expansions;
+
+    // What a malLambda needs.
+    const malSymbolIdVec params;
+    const malValuePtr body;
+    malFrameLayoutPtr layout;
+};
+
+struct Frame {
+    Frame(const Proto* proto, malEnvPtr env, size_t base)
+    : proto(proto), pc(proto->code.data()), env(std::move(env))
+    , base(base) { }
+
+    RefCountedPtr<const Proto> proto;
+    const int* pc;
+    malEnvPtr env;
+    size_t base;        // where the result goes on the stack
+};
+
+// Installed by TRY, for the duration of the try* body.
+struct Handler {
+    size_t frameCount;
+    size_t stackHeight;
+    malEnvPtr env;
+    const int* catchPc;
+    const int* endPc;
+};
+
+// Each run has its own stack, so that the arguments of a builtin which
+// calls back into the machine stay put.
+class Machine {
+public:
+    malValuePtr run(const Proto* proto, malEnvPtr env);
+
+private:
+    bool recover(malValuePtr excVal);
+
+    malValueIter stackEnd() { return m_stack.data() + m_stack.size(); }
+
+    malValueVec m_stack;
+    std::vector<Frame> m_frames;
+    std::vector<Handler> m_handlers;
+};
+
+// The frames that will exist when the code runs: the ones being compiled,
+// then those of the environment the top level form is compiled in.
+typedef malScope Scope;
+
+class Compiler {
+public:
+    Compiler(bool isTracing);
+
+    ProtoPtr compileTopLevel(malValuePtr form, malEnvPtr env);
+
+private:
+    void compile(malValuePtr form, const Scope& scope, bool isTail);
+    void compileForm(malValuePtr form, const Scope& scope, bool isTail);
+    void compileCall(malValuePtr form, const malList* list, const Scope& scope,
+                     bool isTail);
+    void compileDef(const malList* list, const Scope& scope, bool isMacro);
+    void compileDo(const malList* list, const Scope& scope, bool isTail);
+    void compileFn(const malList* list, const Scope& scope);
+    void compileIf(const malList* list, const Scope& scope, bool isTail);
+    void compileLet(const malList* list, const Scope& scope, bool isTail);
+    void compileSymbol(malSymbolId id, const Scope& scope);
+    void compileTry(const malList* list, const Scope& scope, bool isTail);
+
+    bool isLocal(malSymbolId id, const Scope& scope) const;
+    malValuePtr findMacro(const malList* list, const Scope& scope) const;
+
+    int constant(malValuePtr value);
+    int here() const { return m_proto->code.size(); }
+    void emit(int word) { m_proto->code.push_back(word); }
+    void emit(int op, int a) { emit(op); emit(a); }
+    void emit(int op, int a, int b) { emit(op); emit(a); emit(b); }
+    void patch(int at) { m_proto->code[at] = here(); }
+
+    Proto* m_proto;
+    bool m_isTracing;
+    const malSymbolId m_debugEval;
+};
+
+static const Proto* protoOf(const malLambda* lambda)
+{
+    const malCode* code = lambda->getCode();
+    if (!code || (code->kind() != malCode::BYTECODE)) {
+        return NULL;
+    }
+    return static_cast<const Proto*>(code);
+}
+
+static malSymbolId debugEvalId()
+{
+    static const malSymbolId id = mal::symbolId("DEBUG-EVAL");
+    return id;
+}
+
+static bool isTracing(malEnv* env)
+{
+    malEnvPtr dbgenv = env->find(debugEvalId());
+    return dbgenv && dbgenv->get(debugEvalId())->isTrue();
+}
+
+//
+// The machine.
+//
+
+malValuePtr Proto::execute(malEnvPtr env) const
+{
+    Machine machine;
+    return machine.run(this, env);
+}
+
+void Proto::traceRefs(RefTracer& tracer) const
+{
+    for (auto it = constants.begin(), end = constants.end(); it != end; ++it) {
+        tracer(*it);
+    }
+    for (auto it = protos.begin(), end = protos.end(); it != end; ++it) {
+        tracer(*it);
+    }
+    for (auto it = expansions.begin(), end = expansions.end();
+         it != end; ++it) {
+        tracer(it->macro);
+        tracer(it->code);
+    }
+    tracer(body);
+}
+
+malValuePtr Machine::run(const Proto* entry, malEnvPtr entryEnv)
+{
+    static void* const labels[] = {
+#define X(name) &&op_##name,
+        VM_OPCODES(X)
+#undef X
+    };
+
+#define DISPATCH()      goto *labels[*pc++]
+#define LOAD_FRAME()    do { frame = &m_frames.back();                    \
+                             proto = frame->proto.ptr();                  \
+                             pc = frame->pc;                              \
+                             env = frame->env.ptr(); } while (0)
+#define TARGET(offset)  (proto->code.data() + (offset))
+
+    Frame* frame;
+    const Proto* proto;
+    const int* pc;
+    malEnv* env;
+    malValuePtr result;
+
+    m_frames.push_back(Frame(entry, entryEnv, 0));
+    while (1) {
+        try {
+            LOAD_FRAME();
+            DISPATCH();
+
+        op_CONSTANT:
+            m_stack.push_back(proto->constants[pc[0]]);
+            pc += 1;
+            DISPATCH();
+
+        op_LOCAL: {
+            // An empty slot is a def! which hasn't happened yet.
+            const malValuePtr& value = env->slot(pc[0]);
+            m_stack.push_back(value ? value : env->get(pc[1]));
+            pc += 2;
+            DISPATCH();
+        }
+
+        op_OUTER_LOCAL: {
+            // An empty slot is a def! which hasn't happened yet.
+            const malEnv* outer = env->frameAt(pc[0]);
+            if (outer && outer->slot(pc[1])) {
+                m_stack.push_back(outer->slot(pc[1]));
+            }
+            else {
+                m_stack.push_back(env->get(pc[2]));
+            }
+            pc += 3;
+            DISPATCH();
+        }
+
+        op_GLOBAL: {
+            malEnv* root = env->frameAt(pc[0]);
+            if (!root) {
+                m_stack.push_back(env->get(pc[1]));
+            }
+            else {
+                const malValuePtr*& value = proto->globals[pc[2]];
+                if (!value && !(value = root->lookup(pc[1]))) {
+                    root->get(pc[1]); // reports it's not found
+                }
+                m_stack.push_back(*value);
+            }
+            pc += 3;
+            DISPATCH();
+        }
+
+        op_LOOKUP:
+            m_stack.push_back(env->get(pc[0]));
+            pc += 1;
+            DISPATCH();
+
+        op_SET_LOCAL:
+            env->setSlot(pc[0], m_stack.back());
+            m_stack.pop_back();
+            pc += 1;
+            DISPATCH();
+
+        op_DEFINE_LOCAL:
+            env->setSlot(pc[0], m_stack.back());
+            pc += 1;
+            DISPATCH();
+
+        op_DEFINE:
+            env->set(pc[0], m_stack.back());
+            pc += 1;
+            DISPATCH();
+
+        op_MACRO:
+            m_stack.back() = mal::macro(*VALUE_CAST(malLambda,
+                                                    m_stack.back()));
+            DISPATCH();
+
+        op_POP:
+            m_stack.pop_back();
+            DISPATCH();
+
+        op_JUMP:
+            pc = TARGET(pc[0]);
+            DISPATCH();
+
+        op_JUMP_IF_FALSE: {
+            bool isTrue = m_stack.back()->isTrue();
+            m_stack.pop_back();
+            pc = isTrue ? pc + 1 : TARGET(pc[0]);
+            DISPATCH();
+        }
+
+        op_CLOSURE: {
+            const Proto* fn = proto->protos[pc[0]].ptr();
+            m_stack.push_back(mal::lambda(fn->params, fn->body, frame->env,
+                                          fn->layout,
+                                          proto->protos[pc[0]].ptr()));
+            pc += 1;
+            DISPATCH();
+        }
+
+        op_VECTOR: {
+            malValueIter end = stackEnd();
+            result = mal::vector(end - pc[0], end);
+            m_stack.resize(m_stack.size() - pc[0]);
+            m_stack.push_back(std::move(result));
+            pc += 1;
+            DISPATCH();
+        }
+
+        op_HASH: {
+            malValueIter end = stackEnd();
+            result = mal::hash(end - pc[0], end, true);
+            m_stack.resize(m_stack.size() - pc[0]);
+            m_stack.push_back(std::move(result));
+            pc += 1;
+            DISPATCH();
+        }
+
+        op_CALLEE: {
+            const malLambda* macro = DYNAMIC_CAST(malLambda, m_stack.back());
+            if (!macro || !macro->isMacro()) {
+                pc += 4;
+                DISPATCH();
+            }
+            goto recompile; // the head was a macro after all
+        }
+
+        op_MACRO_GUARD:
+            if (m_stack.back() == proto->constants[pc[4]]) {
+                m_stack.pop_back();
+                pc += 5;
+                DISPATCH();
+            }
+            goto recompile; // the macro has been redefined
+
+        recompile: {
+            // The form is compiled again, or its expansion is, against the
+            // frames it runs in, which have the same layout every time this
+            // code runs. The result is kept until the head changes.
+            Expansion& cached = proto->expansions[pc[3]];
+            if (cached.macro != m_stack.back()) {
+                malValuePtr form = proto->constants[pc[0]];
+                const malLambda* macro = DYNAMIC_CAST(malLambda, m_stack.back());
+                if (macro && macro->isMacro()) {
+                    const malList* list = STATIC_CAST(malList, form);
+                    form = macro->apply(list->begin() + 1, list->end());
+                }
+                Compiler compiler(isTracing(env));
+                cached.code = compiler.compileTopLevel(form, env);
+                cached.macro = m_stack.back();
+            }
+            const Proto* code = cached.code.ptr(); // held by the frame below
+            m_stack.pop_back();
+            if (pc[1]) {
+                frame->proto = code;
+                frame->pc = code->code.data();
+            }
+            else {
+                frame->pc = TARGET(pc[2]);
+                m_frames.push_back(Frame(code, frame->env,
+                                         m_stack.size()));
+            }
+            LOAD_FRAME();
+            DISPATCH();
+        }
+
+        op_CALL: {
+            size_t fnIndex = m_stack.size() - pc[0] - 1;
+            malValueIter args = m_stack.data() + fnIndex + 1;
+            const malValuePtr& op = m_stack[fnIndex];
+            const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+            const Proto* callee = lambda ? protoOf(lambda) : NULL;
+            if (callee) {
+                frame->pc = pc + 1;
+                m_frames.push_back(Frame(callee,
+                                         lambda->makeEnv(args, stackEnd()),
+                                         fnIndex));
+                m_stack.resize(fnIndex);
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            if (const malBuiltIn* builtIn = DYNAMIC_CAST(malBuiltIn, op)) {
+                result = builtIn->apply(args, stackEnd());
+            }
+            else {
+                result = APPLY(op, args, stackEnd());
+            }
+            m_stack.resize(fnIndex);
+            m_stack.push_back(std::move(result));
+            pc += 1;
+            DISPATCH();
+        }
+
+        op_TAIL_CALL: {
+            size_t fnIndex = m_stack.size() - pc[0] - 1;
+            malValueIter args = m_stack.data() + fnIndex + 1;
+            const malValuePtr& op = m_stack[fnIndex];
+            const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+            const Proto* callee = lambda ? protoOf(lambda) : NULL;
+            if (callee) {
+                frame->env = lambda->makeEnv(args, stackEnd());
+                frame->proto = callee;
+                frame->pc = callee->code.data();
+                m_stack.resize(frame->base);
+                LOAD_FRAME();
+                DISPATCH();
+            }
+            if (const malBuiltIn* builtIn = DYNAMIC_CAST(malBuiltIn, op)) {
+                result = builtIn->apply(args, stackEnd());
+            }
+            else {
+                result = APPLY(op, args, stackEnd());
+            }
+            goto do_return;
+        }
+
+        op_RETURN:
+            result = std::move(m_stack.back());
+        do_return:
+            m_stack.resize(frame->base);
+            m_frames.pop_back();
+            if (m_frames.empty()) {
+                return result;
+            }
+            LOAD_FRAME();
+            m_stack.push_back(std::move(result));
+            DISPATCH();
+
+        op_ENTER:
+            frame->env = malEnvPtr(new malEnv(frame->env,
+                                              proto->layouts[pc[0]]));
+            env = frame->env.ptr();
+            pc += 1;
+            DISPATCH();
+
+        op_LEAVE:
+            frame->env = env->outer();
+            env = frame->env.ptr();
+            DISPATCH();
+
+        // Leaving a block by DISPATCH doesn't run destructors, so nothing
+        // which holds a reference is named in one.
+        op_TRY:
+            m_handlers.push_back(Handler {
+                m_frames.size(), m_stack.size(), frame->env,
+                TARGET(pc[0]), TARGET(pc[1])
+            });
+            pc += 2;
+            DISPATCH();
+
+        op_END_TRY:
+            m_handlers.pop_back();
+            DISPATCH();
+
+        op_EVAL:
+            m_stack.push_back(EVAL(proto->constants[pc[0]], frame->env));
+            pc += 1;
+            DISPATCH();
+
+        op_FAIL:
+            throw String(STATIC_CAST(malString,
+                                     proto->constants[pc[0]])->value());
+
+        op_THROW:
+            throw proto->constants[pc[0]];
+
+        op_TRACE:
+            if (isTracing(env)) {
+                std::cout << "EVAL: "
+                          << proto->constants[pc[0]]->print(true) << "\n";
+            }
+            pc += 1;
+            DISPATCH();
+        }
+        catch(String& s) {
+            if (!recover(mal::string(s))) {
+                throw;
+            }
+        }
+        catch (malEmptyInputException&) {
+            // Not an error, continue as if we got nil
+            if (!recover(NULL)) {
+                throw;
+            }
+        }
+        catch(malValuePtr& o) {
+            if (!recover(o)) {
+                throw;
+            }
+        };
+    }
+
+#undef DISPATCH
+#undef LOAD_FRAME
+#undef TARGET
+}
+
+// Unwinds to the innermost try* in this run, if there is one, and sets its
+// frame up to run the catch* block with the exception on the stack.
+bool Machine::recover(malValuePtr excVal)
+{
+    if (m_handlers.empty()) {
+        return false;
+    }
+    const Handler& handler = m_handlers.back();
+    m_frames.erase(m_frames.begin() + handler.frameCount, m_frames.end());
+    m_stack.resize(handler.stackHeight);
+
+    Frame& frame = m_frames.back();
+    frame.env = handler.env;
+    frame.pc = excVal ? handler.catchPc : handler.endPc;
+    m_stack.push_back(excVal ? excVal : mal::nilValue());
+    m_handlers.pop_back();
+    return true;
+}
+
+//
+// The compiler.
+//
+
+static malSpecialForm specialForm(const malList* list)
+{
+    const malSymbol* head = DYNAMIC_CAST(malSymbol, list->item(0));
+    return head ? head->specialForm() : SPECIAL_NONE;
+}
+
+Compiler::Compiler(bool isTracing)
+: m_proto(NULL)
+, m_isTracing(isTracing)
+, m_debugEval(debugEvalId())
+{
+
+}
+
+ProtoPtr Compiler::compileTopLevel(malValuePtr form, malEnvPtr env)
+{
+    ProtoPtr proto(new Proto(malSymbolIdVec(), form));
+    Scope root(env);
+    m_proto = proto.ptr();
+    compile(form, root, true);
+    emit(OP_RETURN);
+    return proto;
+}
+
+// Errors in a form are raised when it runs, as they would be by EVAL.
+void Compiler::compile(malValuePtr form, const Scope& scope, bool isTail)
+{
+    if (m_isTracing) {
+        emit(OP_TRACE, constant(form));
+    }
+    int start = here();
+    try {
+        compileForm(form, scope, isTail);
+    }
+    catch (String& s) {
+        m_proto->code.resize(start);
+        emit(OP_FAIL, constant(mal::string(s)));
+    }
+    catch (malValuePtr& o) {
+        m_proto->code.resize(start);
+        emit(OP_THROW, constant(o));
+    }
+}
+
+void Compiler::compileForm(malValuePtr form, const Scope& scope, bool isTail)
+{
+    if (form.isImmediate()) {
+        emit(OP_CONSTANT, constant(form));
+        return;
+    }
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, form)) {
+        compileSymbol(symbol->id(), scope);
+        return;
+    }
+    if (const malVector* vector = DYNAMIC_CAST(malVector, form)) {
+        for (auto it = vector->begin(), end = vector->end(); it != end; ++it) {
+            compile(*it, scope, false);
+        }
+        emit(OP_VECTOR, vector->count());
+        return;
+    }
+    const malHash* hash = DYNAMIC_CAST(malHash, form);
+    if (hash && !hash->isEvaluated()) {
+        malValuePtr keys = hash->keys();
+        malValuePtr values = hash->values();
+        int count = STATIC_CAST(malList, keys)->count();
+        for (int i = 0; i < count; i++) {
+            emit(OP_CONSTANT, constant(STATIC_CAST(malList, keys)->item(i)));
+            compile(STATIC_CAST(malList, values)->item(i), scope, false);
+        }
+        emit(OP_HASH, 2 * count);
+        return;
+    }
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (!list || list->isEmpty()) {
+        emit(OP_CONSTANT, constant(form));
+        return;
+    }
+
+    int argCount = list->count() - 1;
+    switch (specialForm(list)) {
+        case SPECIAL_DEF:
+            compileDef(list, scope, false);
+            return;
+
+        case SPECIAL_DEFMACRO:
+            compileDef(list, scope, true);
+            return;
+
+        case SPECIAL_DO:
+            compileDo(list, scope, isTail);
+            return;
+
+        case SPECIAL_FN:
+            compileFn(list, scope);
+            return;
+
+        case SPECIAL_IF:
+            compileIf(list, scope, isTail);
+            return;
+
+        case SPECIAL_LET:
+            compileLet(list, scope, isTail);
+            return;
+
+        case SPECIAL_QUASIQUOTE:
+            checkArgsIs("quasiquote", 1, argCount);
+            compile(expandQuasiquote(list->item(1)), scope, isTail);
+            return;
+
+        case SPECIAL_QUOTE:
+            checkArgsIs("quote", 1, argCount);
+            emit(OP_CONSTANT, constant(list->item(1)));
+            return;
+
+        case SPECIAL_TRY:
+            compileTry(list, scope, isTail);
+            return;
+
+        case SPECIAL_NONE:
+            compileCall(form, list, scope, isTail);
+            return;
+    }
+}
+
+void Compiler::compileCall(malValuePtr form, const malList* list,
+                           const Scope& scope, bool isTail)
+{
+    malValuePtr macro = findMacro(list, scope);
+    compile(list->item(0), scope, false);
+    emit(macro ? OP_MACRO_GUARD : OP_CALLEE, constant(form), isTail);
+    int after = here();
+    emit(0, m_proto->expansions.size());
+    m_proto->expansions.push_back(Expansion());
+
+    if (macro) {
+        emit(constant(macro));
+        const malLambda* lambda = STATIC_CAST(malLambda, macro);
+        compile(lambda->apply(list->begin() + 1, list->end()), scope, isTail);
+    }
+    else {
+        for (int i = 1; i < list->count(); i++) {
+            compile(list->item(i), scope, false);
+        }
+        emit(isTail ? OP_TAIL_CALL : OP_CALL, list->count() - 1);
+    }
+    patch(after);
+}
+
+void Compiler::compileDef(const malList* list, const Scope& scope,
+                          bool isMacro)
+{
+    checkArgsIs(isMacro ? "defmacro!" : "def!", 2, list->count() - 1);
+    const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
+    compile(list->item(2), scope, false);
+    if (isMacro) {
+        emit(OP_MACRO);
+    }
+    // A name without a slot, such as one a macro expanded to, goes in the
+    // frame's map, as references to it may already have been compiled to
+    // look further out.
+    int slot = scope.slotOf(id->id());
+    if (slot < 0) {
+        emit(OP_DEFINE, id->id());
+    }
+    else {
+        emit(OP_DEFINE_LOCAL, slot);
+    }
+}
+
+void Compiler::compileDo(const malList* list, const Scope& scope, bool isTail)
+{
+    int argCount = list->count() - 1;
+    checkArgsAtLeast("do", 1, argCount);
+
+    // At the top level each form is compiled when it's reached, so that it
+    // can use the macros defined by the forms before it.
+    bool isTopLevel = scope.isRoot();
+    for (int i = 1; i <= argCount; i++) {
+        if (isTopLevel) {
+            emit(OP_EVAL, constant(list->item(i)));
+        }
+        else {
+            compile(list->item(i), scope, isTail && (i == argCount));
+        }
+        if (i < argCount) {
+            emit(OP_POP);
+        }
+    }
+}
+
+void Compiler::compileFn(const malList* list, const Scope& scope)
+{
+    checkArgsIs("fn*", 2, list->count() - 1);
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    malSymbolIdVec params;
+    for (int i = 0; i < bindings->count(); i++) {
+        const malSymbol* param = VALUE_CAST(malSymbol, bindings->item(i));
+        params.push_back(param->id());
+    }
+
+    ProtoPtr fn(new Proto(params, list->item(2)));
+    Scope inner(new malFrameLayout(malFrameLayout::parameters(params),
+                                   list->begin() + 2, list->end()),
+                &scope);
+    fn->layout = inner.layout();
+    Proto* outer = m_proto;
+    m_proto = fn.ptr();
+    compile(list->item(2), inner, true);
+    emit(OP_RETURN);
+    m_proto = outer;
+
+    emit(OP_CLOSURE, m_proto->protos.size());
+    m_proto->protos.push_back(fn);
+}
+
+void Compiler::compileIf(const malList* list, const Scope& scope, bool isTail)
+{
+    int argCount = list->count() - 1;
+    checkArgsBetween("if", 2, 3, argCount);
+
+    compile(list->item(1), scope, false);
+    emit(OP_JUMP_IF_FALSE, 0);
+    int otherwise = here() - 1;
+    compile(list->item(2), scope, isTail);
+    emit(OP_JUMP, 0);
+    int end = here() - 1;
+    patch(otherwise);
+    if (argCount == 3) {
+        compile(list->item(3), scope, isTail);
+    }
+    else {
+        emit(OP_CONSTANT, constant(mal::nilValue()));
+    }
+    patch(end);
+}
+
+void Compiler::compileLet(const malList* list, const Scope& scope, bool isTail)
+{
+    checkArgsIs("let*", 2, list->count() - 1);
+    const malSequence* bindings = VALUE_CAST(malSequence, list->item(1));
+    int count = checkArgsEven("let*", bindings->count());
+    malSymbolIdVec symbols;
+    bool isTracing = m_isTracing;
+    for (int i = 0; i < count; i += 2) {
+        const malSymbol* var = VALUE_CAST(malSymbol, bindings->item(i));
+        symbols.push_back(var->id());
+        // Binding DEBUG-EVAL may turn tracing on within the let*.
+        isTracing = isTracing || (var->id() == m_debugEval);
+    }
+
+    // The values are evaluated in the new frame too.
+    Scope inner(new malFrameLayout(symbols, list->begin() + 1, list->end()),
+                &scope);
+    emit(OP_ENTER, m_proto->layouts.size());
+    m_proto->layouts.push_back(inner.layout());
+
+    std::swap(isTracing, m_isTracing);
+    for (int i = 0; i < count; i += 2) {
+        const malSymbol* var = STATIC_CAST(malSymbol, bindings->item(i));
+        compile(bindings->item(i + 1), inner, false);
+        emit(OP_SET_LOCAL, inner.slotOf(var->id()));
+    }
+    compile(list->item(2), inner, isTail);
+    emit(OP_LEAVE);
+    std::swap(isTracing, m_isTracing);
+}
+
+void Compiler::compileSymbol(malSymbolId id, const Scope& scope)
+{
+    Scope::Ref ref = scope.resolve(id);
+    switch (ref.kind) {
+        case Scope::SLOT:
+            if (ref.depth == 0) {
+                emit(OP_LOCAL, ref.slot, id);
+            }
+            else {
+                emit(OP_OUTER_LOCAL, ref.depth, ref.slot);
+                emit(id);
+            }
+            break;
+
+        case Scope::ROOT:
+            emit(OP_GLOBAL, ref.depth, id);
+            emit(m_proto->globals.size());
+            m_proto->globals.push_back(NULL);
+            break;
+
+        case Scope::LOOKUP:
+            emit(OP_LOOKUP, id);
+            break;
+    }
+}
+
+void Compiler::compileTry(const malList* list, const Scope& scope, bool isTail)
+{
+    int argCount = list->count() - 1;
+    if (argCount == 1) {
+        compile(list->item(1), scope, isTail);
+        return;
+    }
+    checkArgsIs("try*", 2, argCount);
+    const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+
+    checkArgsIs("catch*", 2, catchBlock->count() - 1);
+    MAL_CHECK(VALUE_CAST(malSymbol,
+        catchBlock->item(0))->value() == "catch*",
+        "catch block must begin with catch*");
+    const malSymbol* excSym = VALUE_CAST(malSymbol, catchBlock->item(1));
+
+    emit(OP_TRY, 0, 0);
+    int handler = here() - 2;
+    compile(list->item(1), scope, false);
+    emit(OP_END_TRY);
+    emit(OP_JUMP, 0);
+    int end = here() - 1;
+
+    // The exception is on the stack, and goes in slot 0 of the catch* frame.
+    patch(handler);
+    malSymbolIdVec symbols(1, excSym->id());
+    Scope inner(new malFrameLayout(symbols,
+                                   catchBlock->begin() + 2, catchBlock->end()),
+                &scope);
+    emit(OP_ENTER, m_proto->layouts.size());
+    m_proto->layouts.push_back(inner.layout());
+    emit(OP_SET_LOCAL, 0);
+    compile(catchBlock->item(2), inner, isTail);
+    emit(OP_LEAVE);
+
+    patch(handler + 1);
+    patch(end);
+}
+
+bool Compiler::isLocal(malSymbolId id, const Scope& scope) const
+{
+    return scope.resolve(id).kind == Scope::SLOT;
+}
+
+// Returns the macro named by the head of the list, if it's defined now.
+// Local variables are never taken to be macros.
+malValuePtr Compiler::findMacro(const malList* list, const Scope& scope) const
+{
+    const malSymbol* head = DYNAMIC_CAST(malSymbol, list->item(0));
+    if (!head || isLocal(head->id(), scope)) {
+        return NULL;
+    }
+    malEnvPtr env = scope.env()->find(head->id());
+    if (!env) {
+        return NULL;
+    }
+    malValuePtr value = env->get(head->id());
+    const malLambda* lambda = DYNAMIC_CAST(malLambda, value);
+    if (!lambda || !lambda->isMacro()) {
+        return NULL;
+    }
+    return value;
+}
+
+int Compiler::constant(malValuePtr value)
+{
+    m_proto->constants.push_back(value);
+    return m_proto->constants.size() - 1;
+}
+
+}
+
+malValuePtr vmEval(malValuePtr ast, malEnvPtr env)
+{
+    Compiler compiler(isTracing(env.ptr()));
+    ProtoPtr code = compiler.compileTopLevel(ast, env);
+    return code->execute(env);
+}
@@ -0,0 +1,131 @@
+#include "MAL.h"
+
+#include "Environment.h"
+#include "ReadLine.h"
+#include "Types.h"
+
+#include <iostream>
+#include <memory>
+
+malValuePtr READ(const String& input);
+String PRINT(malValuePtr ast);
+static void installFunctions(malEnvPtr env);
+//  Installs functions, macros and constants implemented in MAL.
+
+static void makeArgv(malEnvPtr env, int argc, char* argv[]);
+static String safeRep(const String& input, malEnvPtr env);
+
+static ReadLine s_readLine("~/.mal-history");
+
+static malEnvPtr replEnv(new malEnv);
+
+int main(int argc, char* argv[])
+{
+    String prompt = "user> ";
+    String input;
+    installCore(replEnv);
+    installFunctions(replEnv);
+    makeArgv(replEnv, argc - 2, argv + 2);
+    if (argc > 1) {
+        String filename = escape(argv[1]);
+        safeRep(STRF("(load-file %s)", filename.c_str()), replEnv);
+        return 0;
+    }
+    rep("(println (str \"Mal [\" *host-language* \"]\"))", replEnv);
+    while (s_readLine.get(prompt, input)) {
+        String out = safeRep(input, replEnv);
+        if (out.length() > 0)
+            std::cout << out << "\n";
+    }
+    return 0;
+}
+
+static String safeRep(const String& input, malEnvPtr env)
+{
+    try {
+        return rep(input, env);
+    }
+    catch (malEmptyInputException&) {
+        return String();
+    }
+    catch (malValuePtr& mv) {
+        return "Error: " + mv->print(true);
+    }
+    catch (String& s) {
+        return "Error: " + s;
+    };
+}
+
+static void makeArgv(malEnvPtr env, int argc, char* argv[])
+{
+    malValueVec* args = new malValueVec();
+    for (int i = 0; i < argc; i++) {
+        args->push_back(mal::string(argv[i]));
+    }
+    env->set("*ARGV*", mal::list(args));
+}
+
+// The scratch space the form takes from the Region is given back once its
+// result has been printed.
+String rep(const String& input, malEnvPtr env)
+{
+    Region::Scope scope;
+    return PRINT(EVAL(READ(input), env));
+}
+
+malValuePtr READ(const String& input)
+{
+    return readStr(input);
+}
+
+// Each top level form is compiled to bytecode and run, see VM.cpp.
+malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
+{
+    if (!env) {
+        env = replEnv;
+    }
+    return vmEval(ast, env);
+}
+
+String PRINT(malValuePtr ast)
+{
+    return ast->print(true);
+}
+
+malValuePtr APPLY(const malValuePtr& op,
+                  malValueIter argsBegin, malValueIter argsEnd)
+{
+    switch (typeOf(op)) {
+        case MAL_BUILTIN:
+            return STATIC_CAST(malBuiltIn, op)->apply(argsBegin, argsEnd);
+        case MAL_LAMBDA:
+            return STATIC_CAST(malLambda, op)->apply(argsBegin, argsEnd);
+        default:
+            MAL_FAIL("\"%s\" is not applicable", op->print(true).c_str());
+    }
+}
+
+static const char* malFunctionTable[] = {
+    "(defmacro! cond (fn* (& xs) (if (> (count xs) 0) (list 'if (first xs) (if (> (count xs) 1) (nth xs 1) (throw \"odd number of forms to cond\")) (cons 'cond (rest (rest xs)))))))",
+    "(def! not (fn* (cond) (if cond false true)))",
+    "(def! load-file (fn* (filename) \
+        (eval (read-string (str \"(do \" (slurp filename) \"\nnil)\")))))",
+    "(def! *host-language* \"C++\")",
+};
+
+static void installFunctions(malEnvPtr env) {
+    for (auto &function : malFunctionTable) {
+        rep(function, env);
+    }
+}
+
+// Added to keep the linker happy at step A
+malValuePtr readline(const String& prompt)
+{
+    String input;
+    if (s_readLine.get(prompt, input)) {
+        return mal::string(input);
+    }
+    return mal::nilValue();
+}
+
@@ -61,13 +61,17 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op,
+                  malValueIter argsBegin, malValueIter argsEnd)
 {
-    const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
-    MAL_CHECK(handler != NULL,
-              "\"%s\" is not applicable", op->print(true).c_str());
-
-    return handler->apply(argsBegin, argsEnd);
+    switch (typeOf(op)) {
+        case MAL_BUILTIN:
+            return STATIC_CAST(malBuiltIn, op)->apply(argsBegin, argsEnd);
+        case MAL_LAMBDA:
+            return STATIC_CAST(malLambda, op)->apply(argsBegin, argsEnd);
+        default:
+            MAL_FAIL("\"%s\" is not applicable", op->print(true).c_str());
+    }
 }
 
 #define ARG(type, name) type* name = VALUE_CAST(type, *argsBegin++)
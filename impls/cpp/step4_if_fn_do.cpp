@@ -72,7 +72,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         if (special == "def!") {
             checkArgsIs("def!", 2, argCount);
             const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-            return env->set(id->value(), EVAL(list->item(2), env));
+            return env->set(id->id(), EVAL(list->item(2), env));
         }
 
         if (special == "do") {
@@ -89,11 +89,11 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 
             const malSequence* bindings =
                 VALUE_CAST(malSequence, list->item(1));
-            StringVec params;
+            malSymbolIdVec params;
             for (int i = 0; i < bindings->count(); i++) {
                 const malSymbol* sym =
                     VALUE_CAST(malSymbol, bindings->item(i));
-                params.push_back(sym->value());
+                params.push_back(sym->id());
             }
 
             return mal::lambda(params, list->item(2), env);
@@ -118,21 +118,22 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             for (int i = 0; i < count; i += 2) {
                 const malSymbol* var =
                     VALUE_CAST(malSymbol, bindings->item(i));
-                inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                inner->set(var->id(), EVAL(bindings->item(i+1), inner));
             }
             return EVAL(list->item(2), inner);
         }
     }
 
     // Now we're left with the case of a regular list to be evaluated.
-    std::unique_ptr<malValueVec> items(list->evalItems(env));
-    malValuePtr op = items->at(0);
+    malArgs items;
+    list->evalItems(env, 0, items.items());
+    malValuePtr op = items.items()[0];
     if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
         return EVAL(lambda->getBody(),
-                    lambda->makeEnv(items->begin()+1, items->end()));
+                    lambda->makeEnv(items.begin()+1, items.end()));
     }
     else {
-        return APPLY(op, items->begin()+1, items->end());
+        return APPLY(op, items.begin()+1, items.end());
     }
 }
 
@@ -141,13 +142,17 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op,
+                  malValueIter argsBegin, malValueIter argsEnd)
 {
-    const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
-    MAL_CHECK(handler != NULL,
-              "\"%s\" is not applicable", op->print(true).c_str());
-
-    return handler->apply(argsBegin, argsEnd);
+    switch (typeOf(op)) {
+        case MAL_BUILTIN:
+            return STATIC_CAST(malBuiltIn, op)->apply(argsBegin, argsEnd);
+        case MAL_LAMBDA:
+            return STATIC_CAST(malLambda, op)->apply(argsBegin, argsEnd);
+        default:
+            MAL_FAIL("\"%s\" is not applicable", op->print(true).c_str());
+    }
 }
 
 static const char* malFunctionTable[] = {
@@ -101,7 +101,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
             if (special == "def!") {
                 checkArgsIs("def!", 2, argCount);
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
+                return env->set(id->id(), EVAL(list->item(2), env));
             }
 
             if (special == "defmacro!") {
@@ -110,7 +110,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
                 malValuePtr body = EVAL(list->item(2), env);
                 const malLambda* lambda = VALUE_CAST(malLambda, body);
-                return env->set(id->value(), mal::macro(*lambda));
+                return env->set(id->id(), mal::macro(*lambda));
             }
 
             if (special == "do") {
@@ -128,11 +128,11 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 
                 const malSequence* bindings =
                     VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
+                malSymbolIdVec params;
                 for (int i = 0; i < bindings->count(); i++) {
                     const malSymbol* sym =
                         VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
+                    params.push_back(sym->id());
                 }
 
                 return mal::lambda(params, list->item(2), env);
@@ -158,7 +158,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 for (int i = 0; i < count; i += 2) {
                     const malSymbol* var =
                         VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                    inner->set(var->id(), EVAL(bindings->item(i+1), inner));
                 }
                 ast = list->item(2);
                 env = inner;
@@ -216,7 +216,7 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 if (excVal) {
                     // we got some exception
                     env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
+                    env->set(excSym->id(), excVal);
                     ast = catchBlock->item(2);
                 }
                 continue; // TCO
@@ -230,14 +230,16 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 ast = lambda->apply(list->begin()+1, list->end());
                 continue; // TCO
             }
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
+            malArgs args;
+            list->evalItems(env, 1, args.items());
             ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin(), items->end());
+            env = lambda->makeEnv(args.begin(), args.end());
             continue; // TCO
         }
         else {
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
-            return APPLY(op, items->begin(), items->end());
+            malArgs args;
+            list->evalItems(env, 1, args.items());
+            return APPLY(op, args.begin(), args.end());
         }
     }
 }
@@ -247,13 +249,17 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+malValuePtr APPLY(const malValuePtr& op,
+                  malValueIter argsBegin, malValueIter argsEnd)
 {
-    const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
-    MAL_CHECK(handler != NULL,
-              "\"%s\" is not applicable", op->print(true).c_str());
-
-    return handler->apply(argsBegin, argsEnd);
+    switch (typeOf(op)) {
+        case MAL_BUILTIN:
+            return STATIC_CAST(malBuiltIn, op)->apply(argsBegin, argsEnd);
+        case MAL_LAMBDA:
+            return STATIC_CAST(malLambda, op)->apply(argsBegin, argsEnd);
+        default:
+            MAL_FAIL("\"%s\" is not applicable", op->print(true).c_str());
+    }
 }
 
 static bool isSymbol(malValuePtr obj, const String& text)
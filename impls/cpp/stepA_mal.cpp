@@ -14,7 +14,6 @@ static void installFunctions(malEnvPtr env);
 
 static void makeArgv(malEnvPtr env, int argc, char* argv[]);
 static String safeRep(const String& input, malEnvPtr env);
-static malValuePtr quasiquote(malValuePtr obj);
 
 static ReadLine s_readLine("~/.mal-history");
 
@@ -66,8 +65,11 @@ static void makeArgv(malEnvPtr env, int argc, char* argv[])
     env->set("*ARGV*", mal::list(args));
 }
 
+// The scratch space the form takes from the Region is given back once its
+// result has been printed.
 String rep(const String& input, malEnvPtr env)
 {
+    Region::Scope scope;
     return PRINT(EVAL(READ(input), env));
 }
 
@@ -83,8 +85,9 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
     }
     while (1) {
 
-       const malEnvPtr dbgenv = env->find("DEBUG-EVAL");
-       if (dbgenv && dbgenv->get("DEBUG-EVAL")->isTrue()) {
+       static const malSymbolId debugEval = mal::symbolId("DEBUG-EVAL");
+       const malEnvPtr dbgenv = env->find(debugEval);
+       if (dbgenv && dbgenv->get(debugEval)->isTrue()) {
            std::cout << "EVAL: " << PRINT(ast) << "\n";
        }
 
@@ -96,149 +99,154 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         // From here on down we are evaluating a non-empty list.
         // First handle the special forms.
         if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
             int argCount = list->count() - 1;
 
-            if (special == "def!") {
-                checkArgsIs("def!", 2, argCount);
-                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
-            }
-
-            if (special == "defmacro!") {
-                checkArgsIs("defmacro!", 2, argCount);
-
-                const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                malValuePtr body = EVAL(list->item(2), env);
-                const malLambda* lambda = VALUE_CAST(malLambda, body);
-                return env->set(id->value(), mal::macro(*lambda));
-            }
-
-            if (special == "do") {
-                checkArgsAtLeast("do", 1, argCount);
-
-                for (int i = 1; i < argCount; i++) {
-                    EVAL(list->item(i), env);
+            switch (symbol->specialForm()) {
+                case SPECIAL_DEF: {
+                    checkArgsIs("def!", 2, argCount);
+                    const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
+                    return env->set(id->id(), EVAL(list->item(2), env));
                 }
-                ast = list->item(argCount);
-                continue; // TCO
-            }
 
-            if (special == "fn*") {
-                checkArgsIs("fn*", 2, argCount);
+                case SPECIAL_DEFMACRO: {
+                    checkArgsIs("defmacro!", 2, argCount);
 
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
-                for (int i = 0; i < bindings->count(); i++) {
-                    const malSymbol* sym =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
+                    const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
+                    malValuePtr body = EVAL(list->item(2), env);
+                    const malLambda* lambda = VALUE_CAST(malLambda, body);
+                    return env->set(id->id(), mal::macro(*lambda));
                 }
 
-                return mal::lambda(params, list->item(2), env);
-            }
-
-            if (special == "if") {
-                checkArgsBetween("if", 2, 3, argCount);
+                case SPECIAL_DO: {
+                    checkArgsAtLeast("do", 1, argCount);
 
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
-                if (!isTrue && (argCount == 2)) {
-                    return mal::nilValue();
+                    for (int i = 1; i < argCount; i++) {
+                        EVAL(list->item(i), env);
+                    }
+                    ast = list->item(argCount);
+                    continue; // TCO
                 }
-                ast = list->item(isTrue ? 2 : 3);
-                continue; // TCO
-            }
 
-            if (special == "let*") {
-                checkArgsIs("let*", 2, argCount);
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                int count = checkArgsEven("let*", bindings->count());
-                malEnvPtr inner(new malEnv(env));
-                for (int i = 0; i < count; i += 2) {
-                    const malSymbol* var =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                case SPECIAL_FN: {
+                    checkArgsIs("fn*", 2, argCount);
+                    return analyzeFn(ast, env);
                 }
-                ast = list->item(2);
-                env = inner;
-                continue; // TCO
-            }
-
-            if (special == "quasiquote") {
-                checkArgsIs("quasiquote", 1, argCount);
-                ast = quasiquote(list->item(1));
-                continue; // TCO
-            }
 
-            if (special == "quote") {
-                checkArgsIs("quote", 1, argCount);
-                return list->item(1);
-            }
-
-            if (special == "try*") {
-                malValuePtr tryBody = list->item(1);
+                case SPECIAL_IF: {
+                    checkArgsBetween("if", 2, 3, argCount);
 
-                if (argCount == 1) {
-                    ast = tryBody;
+                    bool isTrue = EVAL(list->item(1), env)->isTrue();
+                    if (!isTrue && (argCount == 2)) {
+                        return mal::nilValue();
+                    }
+                    ast = list->item(isTrue ? 2 : 3);
                     continue; // TCO
                 }
-                checkArgsIs("try*", 2, argCount);
-                const malList* catchBlock = VALUE_CAST(malList, list->item(2));
-
-                checkArgsIs("catch*", 2, catchBlock->count() - 1);
-                MAL_CHECK(VALUE_CAST(malSymbol,
-                    catchBlock->item(0))->value() == "catch*",
-                    "catch block must begin with catch*");
 
-                // We don't need excSym at this scope, but we want to check
-                // that the catch block is valid always, not just in case of
-                // an exception.
-                const malSymbol* excSym =
-                    VALUE_CAST(malSymbol, catchBlock->item(1));
-
-                malValuePtr excVal;
-
-                try {
-                    return EVAL(tryBody, env);
+                case SPECIAL_LET: {
+                    checkArgsIs("let*", 2, argCount);
+                    const malSequence* bindings =
+                        VALUE_CAST(malSequence, list->item(1));
+                    int count = checkArgsEven("let*", bindings->count());
+                    malEnvPtr inner(new malEnv(env));
+                    for (int i = 0; i < count; i += 2) {
+                        const malSymbol* var =
+                            VALUE_CAST(malSymbol, bindings->item(i));
+                        inner->set(var->id(), EVAL(bindings->item(i+1), inner));
+                    }
+                    ast = list->item(2);
+                    env = inner;
+                    continue; // TCO
                 }
-                catch(String& s) {
-                    excVal = mal::string(s);
+
+                case SPECIAL_QUASIQUOTE: {
+                    checkArgsIs("quasiquote", 1, argCount);
+                    ast = expandQuasiquote(list->item(1));
+                    continue; // TCO
                 }
-                catch (malEmptyInputException&) {
-                    // Not an error, continue as if we got nil
-                    ast = mal::nilValue();
+
+                case SPECIAL_QUOTE: {
+                    checkArgsIs("quote", 1, argCount);
+                    return list->item(1);
                 }
-                catch(malValuePtr& o) {
-                    excVal = o;
-                };
-
-                if (excVal) {
-                    // we got some exception
-                    env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
-                    ast = catchBlock->item(2);
+
+                case SPECIAL_TRY: {
+                    malValuePtr tryBody = list->item(1);
+
+                    if (argCount == 1) {
+                        ast = tryBody;
+                        continue; // TCO
+                    }
+                    checkArgsIs("try*", 2, argCount);
+                    const malList* catchBlock =
+                        VALUE_CAST(malList, list->item(2));
+
+                    checkArgsIs("catch*", 2, catchBlock->count() - 1);
+                    MAL_CHECK(VALUE_CAST(malSymbol,
+                        catchBlock->item(0))->value() == "catch*",
+                        "catch block must begin with catch*");
+
+                    // We don't need excSym at this scope, but we want to check
+                    // that the catch block is valid always, not just in case of
+                    // an exception.
+                    const malSymbol* excSym =
+                        VALUE_CAST(malSymbol, catchBlock->item(1));
+
+                    malValuePtr excVal;
+
+                    try {
+                        return EVAL(tryBody, env);
+                    }
+                    catch(String& s) {
+                        excVal = mal::string(s);
+                    }
+                    catch (malEmptyInputException&) {
+                        // Not an error, continue as if we got nil
+                        ast = mal::nilValue();
+                    }
+                    catch(malValuePtr& o) {
+                        excVal = o;
+                    };
+
+                    if (excVal) {
+                        // we got some exception
+                        env = malEnvPtr(new malEnv(env));
+                        env->set(excSym->id(), excVal);
+                        ast = catchBlock->item(2);
+                    }
+                    continue; // TCO
                 }
-                continue; // TCO
+
+                case SPECIAL_NONE:
+                    break;
             }
         }
 
         // Now we're left with the case of a regular list to be evaluated.
         malValuePtr op = EVAL(list->item(0), env);
-        if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
-            if (lambda->isMacro()) {
-                ast = lambda->apply(list->begin()+1, list->end());
+        switch (typeOf(op)) {
+            case MAL_LAMBDA: {
+                const malLambda* lambda = STATIC_CAST(malLambda, op);
+                if (lambda->isMacro()) {
+                    ast = lambda->apply(list->begin()+1, list->end());
+                    continue; // TCO
+                }
+                malArgs args;
+                list->evalItems(env, 1, args.items());
+                if (lambda->getCode()) {
+                    // Analysed lambdas make their own tail calls.
+                    return lambda->apply(args.begin(), args.end());
+                }
+                ast = lambda->getBody();
+                env = lambda->makeEnv(args.begin(), args.end());
                 continue; // TCO
             }
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
-            ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin(), items->end());
-            continue; // TCO
-        }
-        else {
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
-            return APPLY(op, items->begin(), items->end());
+
+            default: {
+                malArgs args;
+                list->evalItems(env, 1, args.items());
+                return APPLY(op, args.begin(), args.end());
+            }
         }
     }
 }
@@ -248,56 +256,17 @@ String PRINT(malValuePtr ast)
     return ast->print(true);
 }
 
-malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
-{
-    const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
-    MAL_CHECK(handler != NULL,
-              "\"%s\" is not applicable", op->print(true).c_str());
-
-    return handler->apply(argsBegin, argsEnd);
-}
-
-static bool isSymbol(malValuePtr obj, const String& text)
-{
-    const malSymbol* sym = DYNAMIC_CAST(malSymbol, obj);
-    return sym && (sym->value() == text);
-}
-
-//  Return arg when ast matches ('sym, arg), else NULL.
-static malValuePtr starts_with(const malValuePtr ast, const char* sym)
-{
-    const malList* list = DYNAMIC_CAST(malList, ast);
-    if (!list || list->isEmpty() || !isSymbol(list->item(0), sym))
-        return NULL;
-    checkArgsIs(sym, 1, list->count() - 1);
-    return list->item(1);
-}
-
-static malValuePtr quasiquote(malValuePtr obj)
+malValuePtr APPLY(const malValuePtr& op,
+                  malValueIter argsBegin, malValueIter argsEnd)
 {
-    if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj))
-        return mal::list(mal::symbol("quote"), obj);
-
-    const malSequence* seq = DYNAMIC_CAST(malSequence, obj);
-    if (!seq)
-        return obj;
-
-    const malValuePtr unquoted = starts_with(obj, "unquote");
-    if (unquoted)
-        return unquoted;
-
-    malValuePtr res = mal::list(new malValueVec(0));
-    for (int i=seq->count()-1; 0<=i; i--) {
-        const malValuePtr elt     = seq->item(i);
-        const malValuePtr spl_unq = starts_with(elt, "splice-unquote");
-        if (spl_unq)
-            res = mal::list(mal::symbol("concat"), spl_unq, res);
-         else
-            res = mal::list(mal::symbol("cons"), quasiquote(elt), res);
+    switch (typeOf(op)) {
+        case MAL_BUILTIN:
+            return STATIC_CAST(malBuiltIn, op)->apply(argsBegin, argsEnd);
+        case MAL_LAMBDA:
+            return STATIC_CAST(malLambda, op)->apply(argsBegin, argsEnd);
+        default:
+            MAL_FAIL("\"%s\" is not applicable", op->print(true).c_str());
     }
-    if (DYNAMIC_CAST(malVector, obj))
-        res = mal::list(mal::symbol("vec"), res);
-    return res;
 }
 
 static const char* malFunctionTable[] = {
@@ -0,0 +1,70 @@
+// Reader throughput benchmark.
+//
+// Usage: reader_bench [file]
+// Without a file, about 50 MB of mal source is generated in memory.
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "../reader.h"
+
+namespace {
+
+constexpr size_t kGeneratedSize = 50UL * 1024 * 1024;
+constexpr int kRuns = 3;
+
+std::string generate_source(size_t size) {
+    const std::string chunk =
+        "(def! rule-42 {\"name\" \"limit \\\"hard\\\"\\n\" :enabled true, "
+        ":weights [1 -2 +3 40000]} ; tuning\n"
+        "  '(alpha beta) `(gamma ~delta ~@epsilon) @state ^{:doc \"x\"} "
+        "[x y z])\n";
+
+    std::string source = "(";
+    source.reserve(size + chunk.size() + 2);
+    while (source.size() < size) {
+        source += chunk;
+    }
+    source += ")";
+    return source;
+}
+
+std::string read_file(const char* path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error(std::string("cannot open ") + path);
+    }
+    std::stringstream contents;
+    contents << "(" << file.rdbuf() << ")";
+    return contents.str();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    const std::string source =
+        argc > 1 ? read_file(argv[1]) : generate_source(kGeneratedSize);
+
+    double best_ms = 0;
+    for (int i = 0; i < kRuns; i++) {
+        auto start = std::chrono::steady_clock::now();
+        auto form = read_str(source);
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        if (form == nullptr) {
+            std::cerr << "nothing was read\n";
+            return 1;
+        }
+        if (i == 0 || elapsed.count() < best_ms) {
+            best_ms = elapsed.count();
+        }
+    }
+
+    const double megabytes = static_cast<double>(source.size()) / 1e6;
+    std::cout << "read_str: " << source.size() << " bytes in " << best_ms
+              << " ms, " << megabytes / (best_ms / 1000) << " MB/s\n";
+    return 0;
+}
@@ -1,33 +1,142 @@
 #include "reader.h"
 
+#include <array>
 #include <cassert>
+#include <charconv>
 #include <memory>
-#include <regex>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <system_error>
 #include <vector>
 
 #include "types.h"
 #include "utils.h"
 
-using std::string, std::vector, std::shared_ptr, std::make_shared;
+using std::string, std::string_view, std::vector, std::shared_ptr,
+    std::make_shared;
 
-Reader::Reader(const std::vector<std::string>& tokens) : tokens(tokens) {}
+namespace {
+
+// Character classes of the tokens grammar:
+//   [\s,]*(~@|[\[\]{}()'`~^@]|"(?:\\.|[^\\"])*"?|;.*|[^\s\[\]{}('"`,;)]*)
+enum CharClass : unsigned char {
+    kSkip = 1U << 0U,     // whitespace and commas between tokens
+    kSpecial = 1U << 1U,  // single character tokens
+    kAtomEnd = 1U << 2U,  // characters which can't appear in an atom
+    kNewline = 1U << 3U,  // ends a comment, can't follow a `\` in a string
+};
+
+constexpr auto make_char_classes() {
+    std::array<unsigned char, 256> classes{};
+    auto add = [&classes](string_view chars, unsigned char char_class) {
+        for (char c : chars) {
+            classes[static_cast<unsigned char>(c)] |= char_class;
+        }
+    };
+    add(" \t\n\v\f\r,", kSkip | kAtomEnd);
+    add("[]{}()'`~^@", kSpecial);
+    add("[]{}('\"`,;)", kAtomEnd);
+    add("\n\r", kNewline);
+    return classes;
+}
+
+constexpr auto g_char_classes = make_char_classes();
 
-string Reader::peek() {
-    return this->tokens.at(this->position);
+constexpr bool is(char c, unsigned char char_class) {
+    return (g_char_classes[static_cast<unsigned char>(c)] & char_class) != 0;
 }
 
-string Reader::next() {
+}  // namespace
+
+Reader::Reader(string_view source) : source(source) {
+    scan();
+}
+
+bool Reader::at_end() const {
+    return token.empty();
+}
+
+string_view Reader::peek() {
+    if (at_end()) {
+        throw std::out_of_range("no more tokens");
+    }
+    return token;
+}
+
+string_view Reader::next() {
     auto ret = peek();
-    this->position++;
+    scan();
     return ret;
 }
 
+void Reader::scan() {
+    const size_t size = source.size();
+    size_t pos = position;
+    while (pos < size && is(source[pos], kSkip)) {
+        pos++;
+    }
+
+    const size_t start = pos;
+    if (pos == size) {
+        (void)0;  // no more tokens
+    } else if (source.substr(pos, 2) == "~@") {
+        pos += 2;
+    } else if (is(source[pos], kSpecial)) {
+        pos++;
+    } else if (source[pos] == '"') {
+        // The closing quote is optional here, read_string reports it.
+        for (pos++; pos < size && source[pos] != '"'; pos++) {
+            if (source[pos] == '\\') {
+                if (pos + 1 == size || is(source[pos + 1], kNewline)) {
+                    break;
+                }
+                pos++;
+            }
+        }
+        if (pos < size && source[pos] == '"') {
+            pos++;
+        }
+    } else if (source[pos] == ';') {
+        while (pos < size && !is(source[pos], kNewline)) {
+            pos++;
+        }
+    } else {
+        while (pos < size && !is(source[pos], kAtomEnd)) {
+            pos++;
+        }
+    }
+
+    token = source.substr(start, pos - start);
+    position = pos;
+}
+
 namespace {
 
+// Matches [-+]?[0-9]+, from_chars doesn't accept a leading `+` by itself.
+std::optional<int> parse_int(string_view token) {
+    if (token.starts_with('+')) {
+        token.remove_prefix(1);
+        if (token.starts_with('-')) {
+            return std::nullopt;
+        }
+    }
+
+    int integer = 0;
+    const char* last = token.data() + token.size();
+    auto [ptr, error] = std::from_chars(token.data(), last, integer);
+    if (error == std::errc::invalid_argument || ptr != last) {
+        return std::nullopt;
+    }
+    if (error == std::errc::result_out_of_range) {
+        throw std::runtime_error("integer out of range");
+    }
+    return integer;
+}
+
 shared_ptr<MalType> read_atom(Reader& reader) {
-    string token = reader.next();
+    string_view token = reader.next();
 
     if (token == "nil") {
         return make_shared<MalNil>();
@@ -40,40 +149,35 @@ shared_ptr<MalType> read_atom(Reader& reader) {
     }
 
     if (token.at(0) == ':') {
-        return make_shared<MalKeyword>(std::move(token));
+        return make_shared<MalKeyword>(string(token));
     }
 
     if (token.at(0) == ';') {
         return make_shared<MalEmpty>();
     }
 
-    try {
-        int integer = std::stoi(token);
-        return make_shared<MalInt>(integer);
-    } catch (std::invalid_argument&) {
-        (void)0;  // not an int
+    if (auto integer = parse_int(token)) {
+        return make_shared<MalInt>(*integer);
     }
 
-    return make_shared<MalSymbol>(std::move(token));
+    return make_shared<MalSymbol>(string(token));
 }
 
-vector<shared_ptr<MalType>> read_sequence(Reader& reader, const string& start,
-                                          const string& end) {
+vector<shared_ptr<MalType>> read_sequence(Reader& reader, string_view start,
+                                          string_view end) {
     vector<shared_ptr<MalType>> items;
     if (reader.next() != start) {
         throw std::runtime_error("this is not a list");
     }
 
     while (true) {
-        try {
-            string next_str = reader.peek();
-            if (next_str == end) {
-                reader.next();  // `end` string
-                return items;
-            }
-        } catch (std::out_of_range&) {
+        if (reader.at_end()) {
             throw std::runtime_error("unbalanced parenthesis");
         }
+        if (reader.peek() == end) {
+            reader.next();  // `end` string
+            return items;
+        }
 
         auto form = read_form(reader);
         if (!dyn<MalEmpty>(form)) {
@@ -134,7 +238,7 @@ shared_ptr<MalString> read_string(Reader& reader) {
     return make_shared<MalString>(std::move(out));
 }
 
-shared_ptr<MalList> read_quote(Reader& reader, const string& prefix,
+shared_ptr<MalList> read_quote(Reader& reader, string_view prefix,
                                string symbol) {
     auto quote = reader.next();
     assert(quote == prefix);
@@ -168,12 +272,10 @@ shared_ptr<MalList> read_meta(Reader& reader) {
 }  // namespace
 
 shared_ptr<MalType> read_form(Reader& reader) {
-    string token;
-    try {
-        token = reader.peek();
-    } catch (std::out_of_range&) {
+    if (reader.at_end()) {
         return nullptr;
     }
+    string_view token = reader.peek();
 
     switch (token[0]) {
         case '(':
@@ -203,27 +305,8 @@ shared_ptr<MalType> read_form(Reader& reader) {
     }
 }
 
-std::vector<string> tokenize(const string& str) {
-    std::vector<string> tokens;
-    std::regex tokens_regex(
-        R"__([\s,]*(~@|[\[\]{}()'`~^@]|"(?:\\.|[^\\"])*"?|;.*|[^\s\[\]{}('"`,;)]*))__");
-
-    auto begin = std::sregex_iterator(str.begin(), str.end(), tokens_regex);
-    auto end = std::sregex_iterator();
-
-    for (auto it = begin; it != end; ++it) {
-        std::string match = (*it)[1].str();
-        if (!match.empty()) {
-            tokens.push_back(match);
-        }
-    }
-
-    return tokens;
-}
-
 shared_ptr<MalType> read_str(const string& str) {
-    auto tokens = tokenize(str);
-    Reader reader{tokens};
+    Reader reader{str};
 
     return read_form(reader);
 }
@@ -2,27 +2,31 @@
 
 #include <memory>
 #include <string>
-#include <vector>
+#include <string_view>
 
 #include "types.h"
 
 class Reader {
   public:
-    explicit Reader(const std::vector<std::string>& tokens);
+    // `source` is not copied and must outlive the reader and its tokens.
+    explicit Reader(std::string_view source);
     Reader(Reader&&) = default;
     Reader(const Reader&) = default;
     Reader& operator=(Reader&&) = default;
     Reader& operator=(const Reader&) = default;
     ~Reader() = default;
 
-    std::string next();
-    std::string peek();
+    std::string_view next();
+    std::string_view peek();
+    [[nodiscard]] bool at_end() const;
 
   private:
-    std::vector<std::string> tokens;
-    unsigned int position = 0;
+    void scan();
+
+    std::string_view source;
+    size_t position = 0;
+    std::string_view token;
 };
 
 std::shared_ptr<MalType> read_form(Reader& reader);
-std::vector<std::string> tokenize(const std::string& str);
 std::shared_ptr<MalType> read_str(const std::string& str);